@@ -0,0 +1,336 @@
+/* acauto.c
+ *
+ *   Copyright (C) 2011       Henrik Hautakoski <henrik@fiktivkod.org>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *   MA 02110-1301, USA.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "xalloc.h"
+#include "buffer.h"
+#include "acauto.h"
+
+#define NONE ((unsigned) -1)
+
+struct pattern {
+	char *str;
+	size_t len;
+	unsigned id;
+};
+
+struct output {
+	unsigned id;
+	unsigned next;
+};
+
+struct acauto {
+	/* strings added, released by acauto_build() */
+	struct pattern *pattern;
+	unsigned pattern_nr;
+
+	unsigned char class[256];
+	unsigned classes;
+
+	/* states, state 0 is the root. */
+	unsigned nr;
+	unsigned *next;     /* nr * classes transitions */
+	unsigned *out;      /* first output of the state itself */
+	unsigned *hit;      /* first state on the fail chain with output */
+	unsigned *dict;     /* next state after this one with output */
+
+	struct output *output;
+	unsigned output_nr;
+
+	/* the tables point into a buffer given to acauto_import() */
+	int mapped;
+};
+
+struct acauto* acauto_new(void) {
+
+	return xmallocz(sizeof(struct acauto));
+}
+
+void acauto_add(struct acauto *ac, const char *str, size_t len, unsigned id) {
+
+	struct pattern *p;
+
+	if (!len)
+		return;
+
+	ac->pattern = xrealloc(ac->pattern,
+		sizeof(*ac->pattern) * (ac->pattern_nr + 1));
+	p = ac->pattern + ac->pattern_nr++;
+	p->str = xmemdup(str, len);
+	p->len = len;
+	p->id = id;
+}
+
+static unsigned new_state(struct acauto *ac, unsigned *alloc) {
+
+	unsigned i, s = ac->nr++;
+
+	if (ac->nr > *alloc) {
+		*alloc = *alloc ? *alloc * 2 : 16;
+		ac->next = xrealloc(ac->next,
+			sizeof(*ac->next) * *alloc * ac->classes);
+		ac->out = xrealloc(ac->out, sizeof(*ac->out) * *alloc);
+	}
+
+	for(i=0; i < ac->classes; i++)
+		ac->next[s * ac->classes + i] = NONE;
+	ac->out[s] = NONE;
+	return s;
+}
+
+static void build_classes(struct acauto *ac) {
+
+	unsigned i;
+	size_t j;
+
+	/* class 0 is every byte not in any pattern. */
+	memset(ac->class, 0, sizeof(ac->class));
+	ac->classes = 1;
+
+	for(i=0; i < ac->pattern_nr; i++) {
+		struct pattern *p = ac->pattern + i;
+
+		for(j=0; j < p->len; j++) {
+			unsigned char ch = p->str[j];
+
+			if (!ac->class[ch])
+				ac->class[ch] = ac->classes++;
+		}
+	}
+}
+
+static void build_trie(struct acauto *ac) {
+
+	unsigned i, alloc = 0;
+	size_t j;
+
+	new_state(ac, &alloc);
+
+	for(i=0; i < ac->pattern_nr; i++) {
+		struct pattern *p = ac->pattern + i;
+		struct output *o;
+		unsigned s = 0;
+
+		for(j=0; j < p->len; j++) {
+			size_t t = s * ac->classes +
+				ac->class[(unsigned char) p->str[j]];
+
+			/* new_state() may move the table. */
+			if (ac->next[t] == NONE) {
+				unsigned n = new_state(ac, &alloc);
+				ac->next[t] = n;
+			}
+			s = ac->next[t];
+		}
+
+		ac->output = xrealloc(ac->output,
+			sizeof(*ac->output) * (ac->output_nr + 1));
+		o = ac->output + ac->output_nr;
+		o->id = p->id;
+		o->next = ac->out[s];
+		ac->out[s] = ac->output_nr++;
+	}
+}
+
+/*
+ * Breadth first over the trie, computing failure links and filling
+ * in the missing transitions with those of the fail state, which is
+ * always closer to the root and therefore already complete.
+ */
+static void build_dfa(struct acauto *ac) {
+
+	unsigned *queue = xmalloc(sizeof(*queue) * ac->nr);
+	unsigned *fail = xmalloc(sizeof(*fail) * ac->nr);
+	unsigned head = 0, tail = 0, c;
+
+	ac->hit = xmalloc(sizeof(*ac->hit) * ac->nr);
+	ac->dict = xmalloc(sizeof(*ac->dict) * ac->nr);
+
+	fail[0] = 0;
+	ac->hit[0] = ac->dict[0] = NONE;
+
+	for(c=0; c < ac->classes; c++) {
+		unsigned *t = &ac->next[c];
+
+		if (*t == NONE) {
+			*t = 0;
+			continue;
+		}
+		fail[*t] = 0;
+		queue[tail++] = *t;
+	}
+
+	while(head < tail) {
+		unsigned s = queue[head++];
+		unsigned f = fail[s];
+
+		/* outputs of the longest proper suffix with any. */
+		ac->dict[s] = ac->out[f] != NONE ? f : ac->dict[f];
+		ac->hit[s] = ac->out[s] != NONE ? s : ac->dict[s];
+
+		for(c=0; c < ac->classes; c++) {
+			unsigned *t = &ac->next[s * ac->classes + c];
+			unsigned ft = ac->next[f * ac->classes + c];
+
+			if (*t == NONE) {
+				*t = ft;
+				continue;
+			}
+			fail[*t] = ft;
+			queue[tail++] = *t;
+		}
+	}
+
+	free(queue);
+	free(fail);
+}
+
+void acauto_build(struct acauto *ac) {
+
+	unsigned i;
+
+	build_classes(ac);
+	build_trie(ac);
+	build_dfa(ac);
+
+	for(i=0; i < ac->pattern_nr; i++)
+		free(ac->pattern[i].str);
+	free(ac->pattern);
+	ac->pattern = NULL;
+	ac->pattern_nr = 0;
+}
+
+void acauto_scan(const struct acauto *ac, const char *subject, size_t len,
+		acauto_fn fn, void *data) {
+
+	const unsigned char *it = (const unsigned char *) subject;
+	const unsigned char *end = it + len;
+	unsigned s = 0;
+
+	if (!ac->nr)
+		return;
+
+	for(; it < end; it++) {
+		unsigned h, o;
+
+		s = ac->next[s * ac->classes + ac->class[*it]];
+
+		for(h = ac->hit[s]; h != NONE; h = ac->dict[h]) {
+			for(o = ac->out[h]; o != NONE; o = ac->output[o].next) {
+				if (fn(ac->output[o].id, data))
+					return;
+			}
+		}
+	}
+}
+
+/*
+ * Layout of an exported automaton, words in host byte order:
+ *
+ *   nr, classes, output_nr, class[256] (bytes)
+ *   next[nr * classes], out[nr], hit[nr], dict[nr]
+ *   output_nr * (id, next)
+ */
+#define EXPORT_HDR (3 * sizeof(unsigned) + 256)
+
+static void append_words(struct buffer *buf, const unsigned *w, size_t n) {
+
+	if (n)
+		buffer_append(buf, w, sizeof(*w) * n);
+}
+
+void acauto_export(const struct acauto *ac, struct buffer *buf) {
+
+	unsigned hdr[3];
+
+	hdr[0] = ac->nr;
+	hdr[1] = ac->classes;
+	hdr[2] = ac->output_nr;
+	buffer_append(buf, hdr, sizeof(hdr));
+	buffer_append(buf, ac->class, sizeof(ac->class));
+
+	append_words(buf, ac->next, (size_t) ac->nr * ac->classes);
+	append_words(buf, ac->out, ac->nr);
+	append_words(buf, ac->hit, ac->nr);
+	append_words(buf, ac->dict, ac->nr);
+	if (ac->output_nr)
+		buffer_append(buf, ac->output,
+			sizeof(*ac->output) * ac->output_nr);
+}
+
+size_t acauto_import(const void *buf, size_t size, struct acauto **out) {
+
+	const unsigned char *p = buf;
+	struct acauto *ac;
+	unsigned hdr[3];
+	size_t need;
+
+	if (size < EXPORT_HDR)
+		return 0;
+	memcpy(hdr, p, sizeof(hdr));
+
+	need = EXPORT_HDR + sizeof(unsigned) * ((size_t) hdr[0] * hdr[1] +
+		(size_t) hdr[0] * 3) + sizeof(struct output) * hdr[2];
+	if (hdr[1] > 256 || need > size)
+		return 0;
+
+	ac = xmallocz(sizeof(*ac));
+	ac->mapped = 1;
+	ac->nr = hdr[0];
+	ac->classes = hdr[1];
+	ac->output_nr = hdr[2];
+	memcpy(ac->class, p + sizeof(hdr), sizeof(ac->class));
+
+	p += EXPORT_HDR;
+	ac->next = (unsigned *) p;
+	p += sizeof(unsigned) * (size_t) ac->nr * ac->classes;
+	ac->out = (unsigned *) p;
+	p += sizeof(unsigned) * ac->nr;
+	ac->hit = (unsigned *) p;
+	p += sizeof(unsigned) * ac->nr;
+	ac->dict = (unsigned *) p;
+	p += sizeof(unsigned) * ac->nr;
+	ac->output = (struct output *) p;
+
+	*out = ac;
+	return need;
+}
+
+void acauto_free(struct acauto *ac) {
+
+	unsigned i;
+
+	if (!ac)
+		return;
+
+	for(i=0; i < ac->pattern_nr; i++)
+		free(ac->pattern[i].str);
+	free(ac->pattern);
+	if (ac->mapped) {
+		free(ac);
+		return;
+	}
+	free(ac->next);
+	free(ac->out);
+	free(ac->hit);
+	free(ac->dict);
+	free(ac->output);
+	free(ac);
+}
@@ -0,0 +1,68 @@
+/* acauto.h
+ *
+ *   Copyright (C) 2011       Henrik Hautakoski <henrik@fiktivkod.org>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *   MA 02110-1301, USA.
+ */
+#ifndef ACAUTO_H
+#define ACAUTO_H
+
+#include <stddef.h>
+
+/*
+ * Aho-Corasick automaton, finds all occurrences of a set of
+ * strings in a single pass over the subject.
+ *
+ * Strings are added with an id, then acauto_build() turns them into
+ * a DFA. The transition table works on byte classes (all bytes that
+ * don't appear in any string share one) to keep it small.
+ */
+struct acauto;
+
+struct acauto* acauto_new(void);
+
+/* May only be called before acauto_build(). */
+void acauto_add(struct acauto *ac, const char *str, size_t len, unsigned id);
+
+void acauto_build(struct acauto *ac);
+
+/*
+ * 'fn' is called with the id of every string found, once for each
+ * occurrence. Scanning stops if 'fn' returns non-zero.
+ */
+typedef int (*acauto_fn)(unsigned id, void *data);
+
+void acauto_scan(const struct acauto *ac, const char *subject, size_t len,
+		acauto_fn fn, void *data);
+
+/*
+ * A built automaton can be stored and used again without building it.
+ * The tables are in host byte order, aligned to the size of a word.
+ */
+struct buffer;
+
+void acauto_export(const struct acauto *ac, struct buffer *buf);
+
+/*
+ * Wrap tables exported by acauto_export() in a handle without copying
+ * them, 'buf' must be word aligned and outlive the handle. Returns the
+ * bytes used, 0 if they don't fit in 'size'.
+ */
+size_t acauto_import(const void *buf, size_t size, struct acauto **ac);
+
+void acauto_free(struct acauto *ac);
+
+#endif /* ACAUTO_H */
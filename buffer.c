@@ -37,14 +37,16 @@ void buffer_init(struct buffer *b) {
 
 void buffer_expand(struct buffer *b, size_t len) {
 
-	if (b->len + len <= b->size)
+	/* always keep room for the terminating NUL,
+	   buffer_setlen() never lets len reach size. */
+	if (b->len + len < b->size)
 		return;
 	if (!b->size)
 		b->block = NULL;
 
 	do
 		b->size += CHNK_SIZE;
-	while(b->len + len > b->size);
+	while(b->len + len >= b->size);
 
 	b->block = realloc(b->block, b->size);
 }
@@ -27,11 +27,17 @@
 #include <fcntl.h>
 #include <arpa/inet.h>
 #include "sha1_io.h"
+#include "buffer.h"
+#include "filter.h"
+#include "keyword.h"
 #include "cconf.h"
 
 /* we count NULL as part of the string ondisk */
 #define strsize(str) (strlen(str) + 1)
 
+/* bytes of padding needed at 'offset' */
+#define padding(offset) ((CCONF_ALIGN - (offset) % CCONF_ALIGN) % CCONF_ALIGN)
+
 static void* read_entry_nr(void *buf, unsigned int *out) {
 
 	memcpy(out, buf, sizeof(*out));
@@ -46,22 +52,32 @@ void cconf_free(struct cconf *c) {
 	if (!c)
 		return;
 
-	if (c->map.buf) {
-		free(c->target);
-		munmap(c->map.buf, c->map.size);
-	} else if (c->nr) {
-		for(i=0; i < c->nr; i++) {
-			struct target *t = c->target + i;
-			free(t->src);
-			for(j=0; j < t->nr; j++) {
-				struct filter *f = t->filter + i;
+	for(i=0; i < c->nr; i++) {
+		struct target *t = c->target + i;
+
+		for(j=0; j < t->nr; j++) {
+			struct filter *f = t->filter + j;
+
+			/* strings point into the mapping otherwise. */
+			if (!c->map.buf) {
 				free(f->pattern);
 				free(f->dest);
 			}
-			free(t->filter);
 		}
-		free(c->target);
+		if (!c->map.buf)
+			free(t->src);
+		filter_set_free(t->set);
+		free(t->filter);
 	}
+	free(c->target);
+	keyword_set_free(c->keywords);
+
+	for(i=0; i < c->regex_nr; i++)
+		filter_free(c->regex[i]);
+	free(c->regex);
+
+	if (c->map.buf)
+		munmap(c->map.buf, c->map.size);
 }
 
 struct target* cconf_new_target(struct cconf *c) {
@@ -85,11 +101,32 @@ void cconf_add_filter(struct target *t, struct filter *filter) {
 	memcpy(&t->filter[t->nr++], filter, sizeof(*filter));
 }
 
-static size_t parse_filter(void *buf, struct target *target) {
+static struct filter_regex* add_regex(struct cconf *c, struct filter_regex *r) {
+
+	c->regex = realloc(c->regex, sizeof(*c->regex) * (c->regex_nr + 1));
+	c->regex[c->regex_nr++] = r;
+	return r;
+}
+
+/* Keyword filters started with '=' before version 4, and
+   version 1 had none. */
+static int is_keyword(const char *pattern, unsigned version) {
+
+	if (version >= 4)
+		return is_keyword_filter(pattern);
+	return version >= 2 && pattern[0] == '=';
+}
+
+/* 'imported' is set if the keyword set was read from the file. */
+static size_t parse_filter(void *buf, struct target *target,
+			struct cconf *c, unsigned version, int imported) {
 
 	size_t offset = read_entry_nr(buf, &target->nr) - buf;
 
 	if (target->nr) {
+		struct filter_regex **regex;
+		int *keyword, keywords = 0;
+		unsigned idx = 0;
 		int i;
 
 		target->filter = malloc(sizeof(*target->filter) * target->nr);
@@ -102,6 +139,50 @@ static size_t parse_filter(void *buf, struct target *target) {
 
 			filter->dest = (char *) buf + offset;
 			offset += strsize(buf + offset);
+
+			filter->keyword = -1;
+			if (is_keyword(filter->pattern, version)) {
+				filter->regex = NULL;
+				keywords++;
+				if (version >= 2)
+					offset = read_entry_nr(buf + offset,
+						&idx) - buf;
+
+				/* the id in the set stored, from version 3. */
+				if (imported) {
+					filter->keyword = idx;
+					continue;
+				}
+				if (!c->keywords)
+					c->keywords = keyword_set_new();
+				filter->keyword = keyword_set_add(c->keywords,
+					filter->pattern);
+				continue;
+			}
+
+			if (version < 2) {
+				/* compile once, it is matched for every item. */
+				filter->regex = add_regex(c,
+					filter_compile(filter->pattern));
+				continue;
+			}
+
+			offset = read_entry_nr(buf + offset, &idx) - buf;
+			filter->regex = idx < c->regex_nr ? c->regex[idx] : NULL;
+		}
+
+		regex = malloc(sizeof(*regex) * target->nr);
+		for(i=0; i < target->nr; i++)
+			regex[i] = target->filter[i].regex;
+		target->set = filter_set_new(regex, target->nr);
+		free(regex);
+
+		if (keywords) {
+			keyword = malloc(sizeof(*keyword) * target->nr);
+			for(i=0; i < target->nr; i++)
+				keyword[i] = target->filter[i].keyword;
+			filter_set_keywords(target->set, c->keywords, keyword);
+			free(keyword);
 		}
 	}
 	return offset;
@@ -117,16 +198,80 @@ static size_t parse_target(void *buf, struct target *target) {
 	return offset;
 }
 
+static void* parse_regex(void *buf, struct cconf *c) {
+
+	const char *engine = buf;
+	int compat;
+	unsigned i;
+
+	buf += strsize(engine);
+	buf = read_entry_nr(buf, &c->regex_nr);
+	buf += padding(buf - c->map.buf);
+
+	/* bytecode from another pcre version is of no use. */
+	compat = !strcmp(engine, filter_engine_version());
+
+	c->regex = calloc(c->regex_nr ? c->regex_nr : 1, sizeof(*c->regex));
+
+	for(i=0; i < c->regex_nr; i++) {
+		unsigned code_size, study_size;
+		const char *pattern;
+		void *code, *study;
+
+		buf = read_entry_nr(buf, &code_size);
+		buf = read_entry_nr(buf, &study_size);
+
+		pattern = buf;
+		buf += strsize(pattern);
+		buf += padding(buf - c->map.buf);
+
+		code = buf;
+		buf += code_size + padding(code_size);
+		study = study_size ? buf : NULL;
+		buf += study_size + padding(study_size);
+
+		/* the pattern didn't compile when it was written. */
+		if (!code_size)
+			c->regex[i] = NULL;
+		else if (compat)
+			c->regex[i] = filter_import(pattern, code, study);
+		else
+			c->regex[i] = filter_compile(pattern);
+	}
+	return buf;
+}
+
+static void* parse_keywords(void *buf, struct cconf *c) {
+
+	unsigned size;
+
+	buf = read_entry_nr(buf, &size);
+	buf += padding(buf - c->map.buf);
+
+	/* built again from the patterns if it can't be used. */
+	if (size)
+		c->keywords = keyword_set_import(buf, size);
+	return buf + size + padding(size);
+}
+
 static struct cconf* parse(void *buf, size_t size) {
 
 	struct cconf *c = calloc(1, sizeof(struct cconf));
-	int i;
+	unsigned version = ntohl(((struct cconf_header *) buf)->version);
+	int i, imported;
 
 	/* move! */
 	c->map.buf = buf;
 	c->map.size = size;
 
-	buf = read_entry_nr(buf + sizeof(struct cconf_header), &c->nr);
+	buf += sizeof(struct cconf_header);
+	if (version >= 2)
+		buf = parse_regex(buf, c);
+	if (version >= 3)
+		buf = parse_keywords(buf, c);
+	imported = c->keywords != NULL;
+
+	buf = read_entry_nr(buf, &c->nr);
 
 	c->target = calloc(sizeof(struct target), c->nr);
 
@@ -134,8 +279,11 @@ static struct cconf* parse(void *buf, size_t size) {
 		struct target *target = c->target + i;
 
 		buf += parse_target(buf, target);
-		buf += parse_filter(buf, target);
+		buf += parse_filter(buf, target, c, version, imported);
 	}
+
+	if (c->keywords && !imported)
+		keyword_set_build(c->keywords);
 	return c;
 }
 
@@ -145,7 +293,8 @@ static int validate_hdr(struct cconf_header *hdr, size_t size) {
 	unsigned char sha1[20];
 
 	if (hdr->signature != htonl(CCONF_SIGNATURE) ||
-		hdr->version != htonl(1))
+		ntohl(hdr->version) < 1 ||
+		ntohl(hdr->version) > CCONF_VERSION)
 		return -1;
 	SHA1_Init(&ctx);
 	SHA1_Update(&ctx, hdr, offsetof(struct cconf_header, crc));
@@ -188,14 +337,156 @@ error:
 	return NULL;
 }
 
+/* a filter and its position among all filters of the config. */
+struct pattern_ref {
+	const char *pattern;
+	unsigned pos;
+};
+
+static int cmp_pattern(const void *a, const void *b) {
+
+	const struct pattern_ref *x = a, *y = b;
+
+	return strcmp(x->pattern, y->pattern);
+}
+
+static void write_padding(SHA_CTX *ctx, int fd, size_t *offset) {
+
+	static const char zero[CCONF_ALIGN];
+	size_t n = padding(*offset);
+
+	sha1_write(ctx, fd, zero, n);
+	*offset += n;
+}
+
+/*
+ * Write the table of compiled patterns. Each distinct pattern is
+ * compiled once, the returned array maps filters (in the order they
+ * are written) to their index in the table.
+ */
+static unsigned* write_regex(SHA_CTX *ctx, int fd, struct cconf *c,
+			size_t *offset) {
+
+	const char *engine = filter_engine_version();
+	struct pattern_ref *ref;
+	unsigned i, j, n = 0, nr = 0, pos = 0, *idx;
+
+	for(i=0; i < c->nr; i++)
+		n += c->target[i].nr;
+	ref = malloc(sizeof(*ref) * (n ? n : 1));
+	idx = malloc(sizeof(*idx) * (n ? n : 1));
+
+	for(n=0, i=0; i < c->nr; i++) {
+		for(j=0; j < c->target[i].nr; j++) {
+			const char *pattern = c->target[i].filter[j].pattern;
+
+			/* keyword filters are not compiled. */
+			if (is_keyword_filter(pattern))
+				idx[pos] = -1;
+			else {
+				ref[n].pattern = pattern;
+				ref[n++].pos = pos;
+			}
+			pos++;
+		}
+	}
+	qsort(ref, n, sizeof(*ref), cmp_pattern);
+
+	/* count distinct patterns */
+	for(i=0; i < n; i++) {
+		if (!i || strcmp(ref[i - 1].pattern, ref[i].pattern))
+			nr++;
+	}
+
+	sha1_write(ctx, fd, engine, strsize(engine));
+	sha1_write_int(ctx, fd, nr);
+	*offset += strsize(engine) + 4;
+	write_padding(ctx, fd, offset);
+
+	for(nr=0, i=0; i < n; i++) {
+		const char *pattern = ref[i].pattern;
+		struct filter_regex *regex;
+		const void *code = NULL, *study = NULL;
+		size_t code_size = 0, study_size = 0;
+
+		if (i && !strcmp(ref[i - 1].pattern, pattern)) {
+			idx[ref[i].pos] = nr - 1;
+			continue;
+		}
+
+		regex = filter_compile(pattern);
+		if (regex)
+			filter_export(regex, &code, &code_size,
+				&study, &study_size);
+
+		sha1_write_int(ctx, fd, code_size);
+		sha1_write_int(ctx, fd, study_size);
+		sha1_write(ctx, fd, pattern, strsize(pattern));
+		*offset += 8 + strsize(pattern);
+		write_padding(ctx, fd, offset);
+
+		sha1_write(ctx, fd, code, code_size);
+		*offset += code_size;
+		write_padding(ctx, fd, offset);
+		sha1_write(ctx, fd, study, study_size);
+		*offset += study_size;
+		write_padding(ctx, fd, offset);
+
+		filter_free(regex);
+		idx[ref[i].pos] = nr++;
+	}
+	free(ref);
+	return idx;
+}
+
+/*
+ * Write the keyword set of all keyword filters, built here. Their id
+ * in it goes in 'idx', which has the patterns of the other filters.
+ */
+static void write_keywords(SHA_CTX *ctx, int fd, struct cconf *c,
+			unsigned *idx, size_t *offset) {
+
+	struct buffer buf = BUFFER_INIT;
+	struct keyword_set *ks = NULL;
+	unsigned i, j, pos = 0;
+
+	for(i=0; i < c->nr; i++) {
+		for(j=0; j < c->target[i].nr; j++, pos++) {
+			const char *pattern = c->target[i].filter[j].pattern;
+
+			if (!is_keyword_filter(pattern))
+				continue;
+			if (!ks)
+				ks = keyword_set_new();
+			idx[pos] = keyword_set_add(ks, pattern);
+		}
+	}
+
+	if (ks) {
+		keyword_set_build(ks);
+		keyword_set_export(ks, &buf);
+		keyword_set_free(ks);
+	}
+
+	sha1_write_int(ctx, fd, buf.len);
+	*offset += 4;
+	write_padding(ctx, fd, offset);
+	sha1_write(ctx, fd, buf.block, buf.len);
+	*offset += buf.len;
+	write_padding(ctx, fd, offset);
+	buffer_free(&buf);
+}
+
 int cconf_write(int fd, struct cconf *c) {
 
-	int i;
+	int i, n = 0;
 	SHA_CTX ctx;
 	struct cconf_header hdr;
+	size_t offset = sizeof(hdr);
+	unsigned *idx;
 
 	hdr.signature = htonl(CCONF_SIGNATURE);
-	hdr.version = htonl(1);
+	hdr.version = htonl(CCONF_VERSION);
 
 	SHA1_Init(&ctx);
 	SHA1_Update(&ctx, &hdr, offsetof(struct cconf_header, crc));
@@ -204,6 +495,9 @@ int cconf_write(int fd, struct cconf *c) {
 	   will be calculated as we write the rest of the data */
 	lseek(fd, sizeof(hdr), SEEK_SET);
 
+	idx = write_regex(&ctx, fd, c, &offset);
+	write_keywords(&ctx, fd, c, idx, &offset);
+
 	/* put number of targets */
 	sha1_write_int(&ctx, fd, c->nr);
 
@@ -211,8 +505,10 @@ int cconf_write(int fd, struct cconf *c) {
 		int j;
 		struct target *target = c->target + i;
 
-		if (!target->src)
+		if (!target->src) {
+			free(idx);
 			return -1;
+		}
 
 		sha1_write(&ctx, fd, target->src, strsize(target->src));
 
@@ -224,8 +520,10 @@ int cconf_write(int fd, struct cconf *c) {
 
 			sha1_write(&ctx, fd, f->pattern, strsize(f->pattern));
 			sha1_write(&ctx, fd, f->dest, strsize(f->dest));
+			sha1_write_int(&ctx, fd, idx[n++]);
 		}
 	}
+	free(idx);
 
 	SHA1_Final(hdr.crc, &ctx);
 
@@ -26,26 +26,69 @@
 
 /* \232 D C C */
 #define CCONF_SIGNATURE 0xe8444343
+
+/*
+ * Version 2 stores the compiled patterns, each distinct pattern once.
+ * A table of them follows the header, aligned to CCONF_ALIGN bytes:
+ *
+ *   engine version\0, number of patterns, padding
+ *   for each: code size, study data size, pattern\0, padding,
+ *             code, padding, study data, padding
+ *
+ * Each filter refers to its pattern by index in the table, or -1 for
+ * keyword filters (see keyword.h), which aren't compiled. The
+ * bytecode is in host byte order, it is only used if the engine
+ * version matches and compiled from the pattern otherwise.
+ *
+ * Version 3 stores the keyword set of all keyword filters, built,
+ * after the table (see keyword_set_export()):
+ *
+ *   size, padding, keyword set, padding
+ *
+ * and keyword filters refer to their id in it. It is in host byte
+ * order as well, and built from the patterns if it can't be used.
+ *
+ * Version 4 changes the prefix of keyword filters from '=' to
+ * KEYWORD_PREFIX, version 2 and 3 files are read with the old one.
+ */
+#define CCONF_VERSION 4
+#define CCONF_ALIGN 8
+
 struct cconf_header {
 	unsigned int signature;
 	unsigned int version;
 	unsigned char crc[20];
 };
 
+struct filter_regex;
+
 struct filter {
 	char *pattern;
 	char *dest; /* destination, path on filesystem */
+	/* compiled pattern, set by cconf_read() */
+	struct filter_regex *regex;
+	/* id in the config's keyword set, -1 if not a keyword filter. */
+	int keyword;
 };
 
+struct filter_set;
+
 struct target {
 	char *src; /* source. (url) */
 	struct filter *filter;
 	unsigned int nr;
+	/* all filters, matched in one go. set by cconf_read() */
+	struct filter_set *set;
 };
 
 struct cconf {
 	struct target *target;
 	unsigned int nr;
+	/* compiled patterns, shared by the filters. */
+	struct filter_regex **regex;
+	unsigned int regex_nr;
+	/* keyword filters of all targets. */
+	struct keyword_set *keywords;
 	struct {
 		void *buf;
 		unsigned long size;
@@ -31,6 +31,7 @@
 #include "cconf.h"
 #include "lockfile.h"
 #include "filter.h"
+#include "keyword.h"
 #include "version.h"
 
 #define isalias(x) (isalnum(x) || (x) == '-')
@@ -195,7 +196,7 @@ static int parse_filter(struct target *target) {
 	struct filter filter;
 	char pattern[1024];
 	char *alias = NULL;
-	int c, len = 0;
+	int c, len = 0, lineno = config_lineno;
 
 	for(;;) {
 		c = get_next_ch();
@@ -214,8 +215,18 @@ static int parse_filter(struct target *target) {
 	}
 	pattern[len] = '\0';
 
-	if (!pattern[0] || !filter_check_syntax(pattern))
+	if (!pattern[0])
+		return -1;
+	if (is_keyword_filter(pattern)) {
+		if (!keyword_check_syntax(pattern))
+			return -1;
+	} else if (!filter_check_syntax(pattern)) {
 		return -1;
+	} else if (filter_check_backtracking(pattern)) {
+		warn("line %i: filter '%s' backtracks excessively, "
+			"titles it takes too long on are not matched",
+			lineno, pattern);
+	}
 
 	if (c == ' ' || c == '\t') {
 		alias = parse_alias();
@@ -223,6 +234,7 @@ static int parse_filter(struct target *target) {
 			return -1;
 	}
 
+	memset(&filter, 0, sizeof(filter));
 	filter.pattern = strdup(pattern);
 	if (!alias || !alias[0])
 		alias = dest_table[default_dest].key;
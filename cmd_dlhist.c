@@ -4,12 +4,14 @@
 
 int cmd_dlhist(int argc, char **argv) {
 
-	if (dlhist_open() < 0)
+	struct dlhist *d = dlhist_open();
+
+	if (!d)
 		return 1;
 
-	dlhist_print();
+	dlhist_print(d);
 
-	dlhist_close();
+	dlhist_close(d);
 
 	return 0;
 }
@@ -18,25 +18,365 @@
  *   MA 02110-1301, USA.
  */
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include "buffer.h"
+#include "cconf.h"
+#include "env.h"
 #include "error.h"
 #include "filter.h"
+#include "keyword.h"
 #include "version.h"
+#include "xalloc.h"
 
-const char *usagestr = "dlight filter-check <pattern> <subject>";
+const char *usagestr =
+	"dlight filter-check [--profile] <pattern> <subject>\n"
+	"   or: dlight filter-check --corpus <file> [-m|--matches] [<pattern>...]";
 
-int cmd_filter_check(int argc, char **argv) {
+/*
+ * Patterns matched together, either given on the command line
+ * or the filters of a target in the compiled config.
+ */
+struct check_set {
+	struct filter_set *set;
+	const char **pattern;
+	unsigned nr;
+	struct filter_stats *stats;
+	/* compiled here, for patterns from the command line. */
+	struct filter_regex **regex;
+	struct keyword_set *ks;
+};
+
+static void release(struct check_set *cs) {
+
+	unsigned i;
+
+	if (cs->regex) {
+		filter_set_free(cs->set);
+		for(i=0; i < cs->nr; i++)
+			filter_free(cs->regex[i]);
+		free(cs->regex);
+		keyword_set_free(cs->ks);
+	} else if (cs->set) {
+		filter_set_profile(cs->set, NULL);
+	}
+	free(cs->pattern);
+	free(cs->stats);
+}
+
+static int init_patterns(struct check_set *cs, char **pattern, unsigned nr) {
+
+	int *keyword;
+	unsigned i;
+
+	memset(cs, 0, sizeof(*cs));
+	cs->pattern = xmemdup(pattern, sizeof(*pattern) * nr);
+	cs->nr = nr;
+	cs->regex = xmallocz(sizeof(*cs->regex) * nr);
+	keyword = xmalloc(sizeof(*keyword) * nr);
+
+	for(i=0; i < nr; i++) {
+		keyword[i] = -1;
+		if (is_keyword_filter(pattern[i])) {
+			if (!keyword_check_syntax(pattern[i]))
+				goto error;
+			if (!cs->ks)
+				cs->ks = keyword_set_new();
+			keyword[i] = keyword_set_add(cs->ks, pattern[i]);
+		} else {
+			if (!filter_check_syntax(pattern[i]))
+				goto error;
+			cs->regex[i] = filter_compile(pattern[i]);
+		}
+	}
+
+	/* matched as a set, like filters in the config. */
+	cs->set = filter_set_new(cs->regex, nr);
+	if (cs->ks) {
+		keyword_set_build(cs->ks);
+		filter_set_keywords(cs->set, cs->ks, keyword);
+	}
+	free(keyword);
+	return 0;
+error:
+	free(keyword);
+	release(cs);
+	return -1;
+}
+
+static void init_target(struct check_set *cs, struct target *t) {
+
+	unsigned i;
+
+	memset(cs, 0, sizeof(*cs));
+	cs->set = t->set;
+	cs->nr = t->nr;
+	cs->pattern = xmalloc(sizeof(*cs->pattern) * (t->nr ? t->nr : 1));
+	for(i=0; i < t->nr; i++)
+		cs->pattern[i] = t->filter[i].pattern;
+}
+
+static void profile(struct check_set *cs) {
+
+	cs->stats = xmallocz(sizeof(*cs->stats) * (cs->nr ? cs->nr : 1));
+	if (cs->set)
+		filter_set_profile(cs->set, cs->stats);
+}
 
-	if (argc < 3) {
+static int check_one(int argc, char **argv) {
+
+	struct check_set cs;
+	const unsigned *match;
+	int do_profile = 0;
+
+	if (argc > 0 && !strcmp(argv[0], "--profile")) {
+		do_profile = 1;
+		argc--;
+		argv++;
+	}
+
+	if (argc < 2) {
 		usage(usagestr);
 	}
 
-	if (!filter_check_syntax(argv[1]))
+	if (init_patterns(&cs, argv, 1) < 0)
 		return 0;
+	if (do_profile)
+		profile(&cs);
 
-	if (filter_match(argv[1], argv[2])) {
+	if (filter_set_match(cs.set, argv[1], strlen(argv[1]), &match)) {
 		puts("match");
 	} else {
 		puts("nomatch");
 	}
+
+	if (do_profile)
+		printf("evals: %lu, matches: %lu, aborted: %lu, "
+			"time: %.1f us\n", cs.stats->evals, cs.stats->matches,
+			cs.stats->aborted, cs.stats->total / 1e3);
+
+	release(&cs);
+	return 0;
+}
+
+static int read_corpus(const char *file, struct buffer *buf) {
+
+	char chunk[4096];
+	ssize_t n;
+	int fd;
+
+	fd = open(file, O_RDONLY);
+	if (fd < 0)
+		return error("%s: %s", file, strerror(errno));
+
+	while((n = read(fd, chunk, sizeof(chunk))) > 0)
+		buffer_append(buf, chunk, n);
+	close(fd);
+
+	if (n < 0)
+		return error("%s: %s", file, strerror(errno));
+	return 0;
+}
+
+static double elapsed(struct timespec *start) {
+
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec - start->tv_sec) +
+		(ts.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* a pattern and its statistics, for sorting them across sets. */
+struct pattern_cost {
+	const char *pattern;
+	struct filter_stats *stats;
+};
+
+static int cmp_cost(const void *a, const void *b) {
+
+	const struct pattern_cost *x = a, *y = b;
+
+	if (x->stats->total != y->stats->total)
+		return x->stats->total < y->stats->total ? 1 : -1;
 	return 0;
 }
+
+static void print_cost(struct check_set *cs, unsigned nr) {
+
+	struct pattern_cost *c;
+	unsigned i, j, n = 0;
+
+	for(i=0; i < nr; i++)
+		n += cs[i].nr;
+	c = xmalloc(sizeof(*c) * (n ? n : 1));
+
+	for(n=0, i=0; i < nr; i++) {
+		for(j=0; j < cs[i].nr; j++, n++) {
+			c[n].pattern = cs[i].pattern[j];
+			c[n].stats = cs[i].stats + j;
+		}
+	}
+	qsort(c, n, sizeof(*c), cmp_cost);
+
+	printf("%-10s %-10s %-8s %-8s %-8s %s\n", "total(ms)", "max(us)",
+		"evals", "matches", "aborted", "pattern");
+	for(i=0; i < n; i++) {
+		struct filter_stats *st = c[i].stats;
+
+		printf("%-10.3f %-10.1f %-8lu %-8lu %-8lu %s\n",
+			st->total / 1e6, st->max / 1e3, st->evals,
+			st->matches, st->aborted, c[i].pattern);
+	}
+	free(c);
+}
+
+/* Split the corpus in place into its non-empty lines, which may
+   end in "\n" or "\r\n". */
+static unsigned split_lines(char *p, char ***lines) {
+
+	unsigned nr = 1;
+	size_t len;
+	char *end;
+
+	for(end = p; (end = strchr(end, '\n')); end++)
+		nr++;
+	*lines = xmalloc(sizeof(**lines) * nr);
+
+	for(nr = 0; *p; p = end) {
+		end = strchr(p, '\n');
+		if (end)
+			*end++ = '\0';
+		else
+			end = p + strlen(p);
+
+		len = strlen(p);
+		if (len && p[len - 1] == '\r')
+			p[--len] = '\0';
+		if (len)
+			(*lines)[nr++] = p;
+	}
+	return nr;
+}
+
+/* Match all lines against every set, returns the number of matches. */
+static unsigned match_lines(struct check_set *cs, unsigned nr,
+	char **line, unsigned titles, int show, unsigned *matched) {
+
+	unsigned i, k, matches = 0;
+
+	*matched = 0;
+	for(k=0; k < titles; k++) {
+		int hit = 0;
+
+		for(i=0; i < nr; i++) {
+			const unsigned *match;
+			unsigned j, n;
+
+			if (!cs[i].set)
+				continue;
+
+			n = filter_set_match(cs[i].set, line[k],
+				strlen(line[k]), &match);
+			for(j=0; show && j < n; j++)
+				printf("%s\t%s\n", cs[i].pattern[match[j]], line[k]);
+			matches += n;
+			hit |= n > 0;
+		}
+		*matched += hit;
+	}
+	return matches;
+}
+
+/*
+ * Match every line of a file against the patterns given, or all
+ * filters of the compiled config, and report how fast it went and
+ * what each pattern cost. The time is taken without profiling, a
+ * second pass with it on gives the cost of each pattern.
+ */
+static int check_corpus(int argc, char **argv) {
+
+	struct buffer corpus = BUFFER_INIT;
+	struct cconf *config = NULL;
+	struct check_set *cs;
+	struct timespec start;
+	unsigned i, nr, titles = 0, matched, matches;
+	int show = 0, ret = 1;
+	char **line = NULL;
+	double secs;
+
+	if (argc < 2)
+		usage(usagestr);
+	if (read_corpus(argv[1], &corpus) < 0)
+		return 1;
+	argc -= 2;
+	argv += 2;
+
+	if (argc > 0 && (!strcmp(argv[0], "-m") ||
+		!strcmp(argv[0], "--matches"))) {
+		show = 1;
+		argc--;
+		argv++;
+	}
+
+	if (argc > 0) {
+		nr = 1;
+		cs = xmallocz(sizeof(*cs));
+		if (init_patterns(cs, argv, argc) < 0) {
+			nr = 0;
+			goto out;
+		}
+	} else {
+		char file[4096];
+
+		snprintf(file, sizeof(file), "%s/%s", env_get_dir(), "config");
+		config = cconf_read(file);
+		if (!config) {
+			perror(file);
+			buffer_free(&corpus);
+			return 1;
+		}
+		nr = config->nr;
+		cs = xmallocz(sizeof(*cs) * (nr ? nr : 1));
+		for(i=0; i < nr; i++)
+			init_target(cs + i, config->target + i);
+	}
+
+	titles = split_lines(buffer_cstr(&corpus), &line);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	matches = match_lines(cs, nr, line, titles, show, &matched);
+	secs = elapsed(&start);
+
+	printf("titles: %u, matched: %u (%u matches)\n",
+		titles, matched, matches);
+	printf("time: %.3f ms, %.0f titles/s\n", secs * 1e3,
+		secs > 0 ? titles / secs : 0);
+
+	for(i=0; i < nr; i++)
+		profile(cs + i);
+	match_lines(cs, nr, line, titles, 0, &matched);
+	print_cost(cs, nr);
+	ret = 0;
+out:
+	for(i=0; i < nr; i++)
+		release(cs + i);
+	free(cs);
+	free(line);
+	if (config) {
+		cconf_free(config);
+		free(config);
+	}
+	buffer_free(&corpus);
+	return ret;
+}
+
+int cmd_filter_check(int argc, char **argv) {
+
+	if (argc > 0 && !strcmp(argv[0], "--corpus"))
+		return check_corpus(argc, argv);
+	return check_one(argc, argv);
+}
@@ -1,5 +1,6 @@
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/types.h>
@@ -10,103 +11,542 @@
 #include "error.h"
 #include "cconf.h"
 #include "dlhist.h"
+#include "feed-cache.h"
 #include "proc-cache.h"
 #include "filter.h"
 #include "http.h"
 #include "rss.h"
 #include "version.h"
+#include "xalloc.h"
 
-#define PROC_CACHE_PURGE_INTERVAL (60*60*6) /* 6 hours (in seconds) */
+/* items gone from a feed are kept at least this long (in seconds) */
+#define PROC_CACHE_PURGE_INTERVAL (60*60*6) /* 6 hours */
 #define DLHIST_PURGE_INTERVAL (60*60*24) /* 1 day */
 
+#define DEFAULT_MAX_JOBS 8
+#define DEFAULT_MAX_DOWNLOADS 4
+
+static const char *usagestr =
+	"dlight run [-v|--verbose] [-j <n>|--jobs=<n>] [-d <n>|--downloads=<n>]\n"
+	"                  [-w <n>|--watermark=<n>] [--cache-entries=<n>]\n"
+	"                  [--profile-filters[=<n>]]";
+
+static int verbose;
+
+/* maximum number of feeds fetched concurrently. */
+static unsigned max_jobs = DEFAULT_MAX_JOBS;
+
+/* maximum number of files downloaded concurrently. */
+static unsigned max_downloads = DEFAULT_MAX_DOWNLOADS;
+
+/* stop reading a feed after this many consecutive items
+   that are in the proc cache, 0 reads all of it. */
+static unsigned watermark;
+
+/* most items kept in the proc cache, 0 uses the default. */
+static unsigned cache_entries;
+
+/* number of filters listed by --profile-filters, 0 if not profiling. */
+static unsigned profile_top;
+
+#define DEFAULT_PROFILE_TOP 10
+#define PROFILE_REPORT "filter-profile"
+
 static int write_http_file(struct http_file *file, const char *dest) {
 
-	char path[4096];
-	snprintf(path, sizeof(path), "%s/%s", dest, file->filename);
-	return buffer_write(&file->data, path);
+	if (http_file_link(file, dest) < 0)
+		return warn("%s/%s: %s", dest, file->filename, strerror(errno));
+	return 0;
 }
 
-static int process_rss_item(struct rss_item *item, struct target *t) {
+/*
+ * Per target state for the current run.
+ */
+struct feed {
+	struct target *target;
+	/* per filter match statistics, if profiling. */
+	struct filter_stats *stats;
+	/* parser fed from the transfer, created on the first chunk. */
+	rss_push_t parser;
+	/* validators of the response, saved once all
+	   downloads queued from it are done. */
+	char *etag;
+	char *last_modified;
+	/* consecutive items found in the proc cache. */
+	unsigned seen;
+	unsigned pending;
+	unsigned failed:1;
+	unsigned walked:1;
+	/* reading stopped at the watermark. */
+	unsigned stopped:1;
+};
+
+/*
+ * A matched item waiting for its file to be downloaded.
+ */
+struct download {
+	struct download *next;
+	struct feed *feed;
+	char *title;
+	char *link;
+	unsigned nr;
+	struct filter **filter;
+};
+
+/* downloads that are queued or in flight. */
+static struct download *downloads;
+
+static struct http_multi *multi;
+
+static struct proc_cache *proc_cache;
+static struct dlhist *dlhist;
+
+static struct download* find_download(const char *link) {
+
+	struct download *dl;
+
+	for(dl = downloads; dl; dl = dl->next) {
+		if (!strcmp(dl->link, link))
+			return dl;
+	}
+	return NULL;
+}
 
-	int i, ret = 0;
-	struct http_file *file = NULL;
+/* A download of 'title' to 'dest' is queued, from any link. */
+static int find_queued(const char *title, const char *dest) {
 
-	for(i=0; i < t->nr; i++) {
-		struct filter *filter = &t->filter[i];
+	struct download *dl;
+	unsigned i;
 
-		if (!filter_match(filter->pattern, item->title))
+	for(dl = downloads; dl; dl = dl->next) {
+		if (strcmp(dl->title, title))
 			continue;
+		for(i=0; i < dl->nr; i++) {
+			if (!strcmp(dl->filter[i]->dest, dest))
+				return 1;
+		}
+	}
+	return 0;
+}
+
+static void free_download(struct download *dl) {
 
-		/* fetch the file if we haven't already. */
-		if (file == NULL) {
-			file = http_fetch_file(item->link);
-
-			/* If we can't fetch the file, set error return code
-			   and continue with next filter. */
-			if (file == NULL) {
-				error("download failed");
-				ret = -1;
-				continue;
-			}
+	struct download **it;
+
+	for(it = &downloads; *it; it = &(*it)->next) {
+		if (*it == dl) {
+			*it = dl->next;
+			break;
 		}
+	}
+
+	free(dl->title);
+	free(dl->link);
+	free(dl->filter);
+	free(dl);
+}
+
+static void feed_done(struct feed *f) {
+
+	if (!f->walked || f->pending)
+		return;
+
+	/* Items with a failed download are only retried if the feed
+	   is fetched in full, so don't keep validators then. */
+	if (f->failed)
+		feed_cache_update(f->target->src, NULL, NULL);
+	else
+		feed_cache_update(f->target->src, f->etag, f->last_modified);
+}
+
+static void process_download(const char *url, struct http_file *file,
+				void *cbdata) {
+
+	struct download *dl = cbdata;
+	struct feed *f = dl->feed;
+	unsigned i, failed = 0;
+
+	f->pending--;
+
+	/* If we can't fetch the file, leave the item out of the
+	   proc cache so it is tried again on the next run. */
+	if (!file) {
+		error("download failed");
+		f->failed = 1;
+		free_download(dl);
+		feed_done(f);
+		return;
+	}
 
-		/* Save to history */
-		dlhist_mark(item->title, filter->dest);
+	for(i=0; i < dl->nr; i++) {
+		struct filter *filter = dl->filter[i];
 
-		if (write_http_file(file, filter->dest) < 0)
+		if (write_http_file(file, filter->dest) < 0) {
+			failed++;
 			continue;
+		}
+
+		/* Save to history, only once it is there as the
+		   history makes later runs skip the destination. */
+		dlhist_mark(dlhist, dl->title, filter->dest);
 
 		printf("Downloaded: %s (%s) to %s\n",
-			item->title, item->link, filter->dest);
+			dl->title, dl->link, filter->dest);
 	}
 
-	http_free_file(file);
-
-	return ret;
+	/* Tried again on the next run for the destinations
+	   it couldn't be written to, the others are skipped. */
+	if (failed)
+		f->failed = 1;
+	else
+		proc_cache_update(proc_cache, f->target->src, dl->link);
+	free_download(dl);
+	feed_done(f);
 }
 
-static void process_rss_file(rss_t rss, struct target *t) {
+/*
+ * Match an item against the target's filters and queue a download
+ * if any of them matched. Returns non-zero if the item is handled
+ * by a download, the proc cache is then updated once it completes.
+ */
+static int process_rss_item(struct rss_item *item, struct feed *f) {
+
+	struct target *t = f->target;
+	struct download *dl;
+	const unsigned *match;
+	unsigned i, n, queued = 0;
 
-	struct rss_item item;
+	if (!t->set)
+		return 0;
 
-	while(rss_walk_next(rss, &item)) {
+	n = filter_set_match(t->set, item->title, strlen(item->title), &match);
+	if (!n)
+		return 0;
 
-		if (proc_cache_lookup(item.link))
+	/* Already queued from another target. */
+	if (find_download(item->link))
+		return 1;
+
+	dl = xmallocz(sizeof(*dl));
+	dl->filter = xmalloc(sizeof(*dl->filter) * n);
+	for(i=0; i < n; i++) {
+		struct filter *filter = &t->filter[match[i]];
+
+		/* Already downloaded there, from another target
+		   or before the item was purged from the proc cache. */
+		if (dlhist_lookup(dlhist, item->title, filter->dest)) {
+			if (verbose)
+				printf("Skipped: %s (%s), already in %s\n",
+					item->title, item->link, filter->dest);
 			continue;
+		}
 
-		/* If something went wrong, do not update proc cache */
-		if (process_rss_item(&item, t) < 0)
+		/* The same title from another link, it isn't marked in
+		   the history until that download is done. */
+		if (find_queued(item->title, filter->dest)) {
+			queued++;
 			continue;
+		}
+		dl->filter[dl->nr++] = filter;
+	}
 
-		proc_cache_update(item.link);
+	/* Left out of the proc cache if another download has it, the
+	   next run skips it or tries again if that one failed. */
+	if (!dl->nr) {
+		free(dl->filter);
+		free(dl);
+		return queued > 0;
 	}
+
+	dl->feed = f;
+	dl->title = xstrdup(item->title);
+	dl->link = xstrdup(item->link);
+
+	dl->next = downloads;
+	downloads = dl;
+	f->pending++;
+	/* the payload is written once, next to the first destination
+	   and then linked (or copied) into the others. */
+	http_multi_fetch_file(multi, dl->link, dl->filter[0]->dest,
+		process_download, dl);
+
+	return 1;
+}
+
+static int process_rss_item_cb(struct rss_item *item, void *data) {
+
+	struct feed *f = data;
+
+	if (proc_cache_lookup(proc_cache, f->target->src, item->link)) {
+		/* Feeds list the newest items first, once we are into
+		   the ones an earlier run handled the rest is old too.
+		   Stopping the parser also aborts the transfer. */
+		if (watermark && ++f->seen >= watermark) {
+			f->stopped = 1;
+			return 1;
+		}
+		return 0;
+	}
+	f->seen = 0;
+
+	/* Matched items are put in the proc cache
+	   when their download is finished. */
+	if (!process_rss_item(item, f))
+		proc_cache_update(proc_cache, f->target->src, item->link);
+	return 0;
+}
+
+/*
+ * Feeds the page to the rss parser as it is received, items are
+ * processed (and their downloads queued) while the rest of the
+ * document is still in transit.
+ */
+static int write_page(const void *buf, size_t size, void *cbdata) {
+
+	struct feed *f = cbdata;
+
+	if (!f->parser)
+		f->parser = rss_push_new(process_rss_item_cb, f,
+			RSS_PUSH_SCAN);
+
+	/* stop the transfer if the parser gave up. */
+	if (rss_push_feed(f->parser, buf, size))
+		return -1;
+	return 0;
+}
+
+static void process_page(const char *url, struct http_page *page,
+				void *cbdata) {
+
+	struct feed *f = cbdata;
+	int ret;
+
+	if (!page)
+		goto out;
+
+	/* Not modified since the last run, nothing to do. */
+	if (page->status == 304)
+		goto out;
+
+	ret = f->parser ? rss_push_end(f->parser) : -1;
+	if (ret < 0) {
+		error("failed to parse rss: %s", f->target->src);
+		goto out;
+	}
+
+	/* every item the feed lists has been seen. */
+	if (!f->stopped)
+		proc_cache_walked(proc_cache, f->target->src);
+
+	if (page->status == 200) {
+		if (page->etag)
+			f->etag = xstrdup(page->etag);
+		if (page->last_modified)
+			f->last_modified = xstrdup(page->last_modified);
+	}
+	f->walked = 1;
+	feed_done(f);
+out:
+	if (f->parser) {
+		rss_push_free(f->parser);
+		f->parser = NULL;
+	}
+}
+
+/*
+ * A filter and its statistics, for sorting them across targets.
+ */
+struct profile_entry {
+	struct target *target;
+	struct filter *filter;
+	struct filter_stats *stats;
+};
+
+static int cmp_profile(const void *a, const void *b) {
+
+	const struct profile_entry *x = a, *y = b;
+
+	if (x->stats->total != y->stats->total)
+		return x->stats->total < y->stats->total ? 1 : -1;
+	return 0;
+}
+
+static int write_profile(struct profile_entry *e, unsigned nr) {
+
+	char file[4096];
+	unsigned i;
+	FILE *fp;
+
+	snprintf(file, sizeof(file), "%s/%s", env_get_dir(), PROFILE_REPORT);
+
+	fp = fopen(file, "w");
+	if (!fp)
+		return warn("%s: %s", file, strerror(errno));
+
+	fprintf(fp, "target\tpattern\tevals\tmatches\taborted\t"
+		"total_ns\tmax_ns\n");
+	for(i=0; i < nr; i++)
+		fprintf(fp, "%s\t%s\t%lu\t%lu\t%lu\t%llu\t%llu\n",
+			e[i].target->src, e[i].filter->pattern,
+			e[i].stats->evals, e[i].stats->matches,
+			e[i].stats->aborted, e[i].stats->total,
+			e[i].stats->max);
+	fclose(fp);
+
+	printf("profile of all filters written to %s\n", file);
+	return 0;
+}
+
+/*
+ * Print the filters that took the most time, and write the
+ * statistics of all of them to a tab separated report.
+ */
+static void report_profile(struct feed *feeds, unsigned nr) {
+
+	struct profile_entry *e;
+	unsigned i, j, n = 0;
+
+	for(i=0; i < nr; i++)
+		n += feeds[i].target->nr;
+	e = xmalloc(sizeof(*e) * (n ? n : 1));
+
+	for(n=0, i=0; i < nr; i++) {
+		struct target *t = feeds[i].target;
+
+		for(j=0; j < t->nr; j++, n++) {
+			e[n].target = t;
+			e[n].filter = t->filter + j;
+			e[n].stats = feeds[i].stats + j;
+		}
+	}
+	qsort(e, n, sizeof(*e), cmp_profile);
+
+	printf("%-10s %-10s %-8s %-8s %s\n",
+		"total(ms)", "max(us)", "evals", "matches", "pattern");
+	for(i=0; i < n && i < profile_top; i++) {
+		struct filter_stats *st = e[i].stats;
+
+		printf("%-10.3f %-10.1f %-8lu %-8lu %s\n",
+			st->total / 1e6, st->max / 1e3,
+			st->evals, st->matches, e[i].filter->pattern);
+	}
+
+	write_profile(e, n);
+	free(e);
 }
 
 static void process(struct cconf *config) {
 
 	int i;
-	struct buffer *data;
+	struct feed *feeds;
+
+	dlhist_purge(dlhist, DLHIST_PURGE_INTERVAL);
 
-	proc_cache_purge(PROC_CACHE_PURGE_INTERVAL);
-	dlhist_purge(DLHIST_PURGE_INTERVAL);
+	multi = http_multi_new(max_jobs, max_downloads);
+	feeds = xmallocz(sizeof(*feeds) * config->nr);
 
 	for(i=0; i < config->nr; i++) {
-		struct target *t = config->target + i;
-		rss_t rss;
+		struct feed *f = feeds + i;
+		const char *etag, *last_modified;
+
+		f->target = config->target + i;
+		if (profile_top && f->target->set) {
+			f->stats = xmallocz(sizeof(*f->stats) * f->target->nr);
+			filter_set_profile(f->target->set, f->stats);
+		}
+		feed_cache_lookup(f->target->src, &etag, &last_modified);
+
+		http_multi_fetch_page(multi, f->target->src,
+			etag, last_modified, write_page, process_page, f);
+	}
+
+	http_multi_run(multi);
+
+	if (verbose) {
+		struct http_stats st;
+
+		http_multi_stats(multi, &st);
+		printf("http: %u requests (%u failed), "
+			"%u new connections, %u reused\n",
+			st.requests, st.failed, st.connects, st.reused);
+	}
+
+	http_multi_free(multi);
+	multi = NULL;
 
-		data = http_fetch_page(t->src);
-		if (!data)
+	/* after the feeds are read, so it knows what they still list. */
+	proc_cache_purge(proc_cache, PROC_CACHE_PURGE_INTERVAL);
+	if (cache_entries)
+		proc_cache_limit(proc_cache, cache_entries);
+
+	if (profile_top)
+		report_profile(feeds, config->nr);
+
+	/* Downloads left behind if the run was aborted. */
+	while(downloads)
+		free_download(downloads);
+
+	for(i=0; i < config->nr; i++) {
+		if (feeds[i].parser)
+			rss_push_free(feeds[i].parser);
+		if (feeds[i].stats)
+			filter_set_profile(feeds[i].target->set, NULL);
+		free(feeds[i].stats);
+		free(feeds[i].etag);
+		free(feeds[i].last_modified);
+	}
+	free(feeds);
+}
+
+static void parse_options(int argc, char **argv) {
+
+	int i, n = -1;
+	unsigned *opt = NULL;
+
+	for(i=0; i < argc; i++) {
+		const char *arg = argv[i];
+
+		if (!strcmp(arg, "-v") || !strcmp(arg, "--verbose")) {
+			verbose = 1;
 			continue;
+		}
 
-		rss = rss_parse(data->block, data->len);
-		if (!rss) {
-			error("failed to parse rss: %s", t->src);
+		if (!strcmp(arg, "--profile-filters")) {
+			profile_top = DEFAULT_PROFILE_TOP;
 			continue;
 		}
 
-		process_rss_file(rss, t);
-		rss_free(rss);
-		http_free(data);
+		if (!strcmp(arg, "-j") && i + 1 < argc) {
+			opt = &max_jobs;
+			n = atoi(argv[++i]);
+		} else if (!strncmp(arg, "--jobs=", 7)) {
+			opt = &max_jobs;
+			n = atoi(arg + 7);
+		} else if (!strcmp(arg, "-d") && i + 1 < argc) {
+			opt = &max_downloads;
+			n = atoi(argv[++i]);
+		} else if (!strncmp(arg, "--downloads=", 12)) {
+			opt = &max_downloads;
+			n = atoi(arg + 12);
+		} else if (!strcmp(arg, "-w") && i + 1 < argc) {
+			opt = &watermark;
+			n = atoi(argv[++i]);
+		} else if (!strncmp(arg, "--watermark=", 12)) {
+			opt = &watermark;
+			n = atoi(arg + 12);
+		} else if (!strncmp(arg, "--cache-entries=", 16)) {
+			opt = &cache_entries;
+			n = atoi(arg + 16);
+		} else if (!strncmp(arg, "--profile-filters=", 18)) {
+			opt = &profile_top;
+			n = atoi(arg + 18);
+		} else {
+			usage(usagestr);
+		}
+
+		if (n < 1)
+			usage(usagestr);
+		*opt = n;
 	}
 }
 
@@ -115,6 +555,8 @@ int cmd_run(int argc, char **argv) {
 	struct cconf *config;
 	char configfile[4096];
 
+	parse_options(argc, argv);
+
 	snprintf(configfile, sizeof(configfile), "%s/%s",
 		env_get_dir(), "config");
 
@@ -124,14 +566,17 @@ int cmd_run(int argc, char **argv) {
 		return 1;
 	}
 
-	/* open process cache and download history. */
-	if (proc_cache_open() < 0 || dlhist_open() < 0)
+	/* open process cache, download history and feed cache. */
+	proc_cache = proc_cache_open();
+	dlhist = dlhist_open();
+	if (!proc_cache || !dlhist || feed_cache_open() < 0)
 		return 1;
 
 	process(config);
 
-	proc_cache_close();
-	dlhist_close();
+	proc_cache_close(proc_cache);
+	dlhist_close(dlhist);
+	feed_cache_close();
 	cconf_free(config);
 
 	return 0;
@@ -21,6 +21,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <arpa/inet.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -29,41 +30,154 @@
 #include "env.h"
 #include "error.h"
 #include "lockfile.h"
-#include "utils.h"
+#include "buffer.h"
+#include "xalloc.h"
 #include "dlhist.h"
 
 /* \195 D L H */
 #define SIGNATURE 0xC3444C48
 #define STORAGE_FILE "dlhist"
+#define LOG_FILE "dlhist.log"
+
+/*
+ * Version 2 keeps each destination path once, in a table after the
+ * header, and the times as varints (7 bits a byte, low bits first) of
+ * how long before the file was written they are. The titles follow
+ * an index with the slots of each shard's table, so the tables are
+ * set up on open without hashing (or copying) a title.
+ *
+ *   header
+ *   dests * path\0
+ *   shards * (size, size * offset) offset of the title + 1, 0 if empty
+ *   titles: title\0, varint dest_nr, dest_nr * (varint id, varint age)
+ *
+ * Version 3 writes the titles in order of their oldest destination,
+ * so a purge reads them from the start and stops at the first one
+ * not expired. Version 1 has no index and the titles list their
+ * destinations as time and path\0. Words are in network byte order.
+ */
+#define VERSION 3
+
+/*
+ * New marks are appended to a log (title, time and destination, like
+ * in a version 1 file) which is replayed on open. The file is only
+ * rewritten once the log is larger than LOG_RATIO of it (and LOG_MIN
+ * bytes), or a purge read more than 1/PURGE_RATIO of the titles.
+ */
+#define LOG_RATIO 4
+#define LOG_MIN 4096
+#define PURGE_RATIO 8
 
 #define HASH_TABLE_LOAD(c, s) ((double) (c) / ((s) ? (s) : 1))
 
 #define TABLE_MIN_SIZE 128
 
+/* Titles are split by the top bits of their hash into
+   shards, each a table with its own lock. */
+#define SHARD_BITS 3
+#define SHARDS (1 << SHARD_BITS)
+
+/* titles added after open are copied into blocks of this size. */
+#define ARENA_BLOCK 65536
+
 struct header {
 	unsigned int signature;
 	unsigned int version;
+	/* the size of the table in version 1, titles in version 2 */
 	unsigned int size;
+	/* version 2 and later */
+	unsigned int shards;
+	unsigned int dests;
+	unsigned int written;
 };
 
-struct destination {
+#define HDR_SZ_V1 (3 * sizeof(unsigned))
+
+/*
+ * Destinations are kept once per path, with the identity of the
+ * directory looked up when the path is first seen. Comparing them
+ * is then done without going to the filesystem.
+ */
+struct dest_info {
 	char *path;
+	dev_t dev;
+	ino_t ino;
+	/* the path doesn't exist (or can't be read) */
+	int missing;
+};
+
+struct destination {
+	unsigned id;
 	unsigned time;
 };
 
 struct hash_entry {
-	char *key;
+	/* in the file read on open, or an arena */
+	const char *key;
 	unsigned dest_nr;
+	/* the destinations, NULL until they are changed, they
+	   are read from the title's record ('rec') until then. */
 	struct destination *dest;
+	const unsigned char *rec;
 };
 
 #define he_empty(x) (!(x)->key)
 
-static struct lockfile lock = LOCKFILE_INIT;
+struct arena {
+	struct arena *next;
+	size_t len;
+	size_t size;
+	char *buf;
+};
+
+struct shard {
+	pthread_mutex_t mutex;
+	struct hash_entry *table;
+	unsigned int table_size;
+	unsigned int table_count;
+	struct arena *arena;
+	/* log records of the marks made since open */
+	struct buffer log;
+};
+
+struct dlhist {
+	struct lockfile lock;
+	struct shard shard[SHARDS];
+	/* destinations, only added to after open. */
+	pthread_rwlock_t dest_lock;
+	struct dest_info *dest;
+	unsigned dest_nr;
+	/* the file, the titles point into it. */
+	unsigned char *buf;
+	unsigned char *end;
+	/* destinations in the file, and when it was written */
+	unsigned file_dests;
+	unsigned written;
+	/* the titles in the file, from version 3 oldest first */
+	const unsigned char *rec;
+	unsigned titles;
+	int sorted;
+	struct log_mark *marks;
+	unsigned marks_nr;
+	/* size of the file and the log on open */
+	size_t file_size;
+	size_t log_size;
+	/* rewrite the file on close */
+	int compact;
+};
+
+/* A title replayed from the log, in the order they were marked. */
+struct log_mark {
+	const char *key;
+	unsigned time;
+};
 
-static struct hash_entry *table;
-static unsigned int table_size;
-static unsigned int table_count;
+struct dest_iter {
+	const unsigned char *rec;
+	unsigned i;
+};
+
+#define DEST_ITER_INIT(he) { (he)->rec, 0 }
 
 static unsigned hash(const char *s) {
 
@@ -74,65 +188,241 @@ static unsigned hash(const char *s) {
         return h;
 }
 
-static struct hash_entry* lookup(const char *key) {
+static const char* arena_strdup(struct arena **arena, const char *str) {
+
+	struct arena *a = *arena;
+	size_t len = strlen(str) + 1;
+	char *ptr;
+
+	if (!a || a->size - a->len < len) {
+		a = xmalloc(sizeof(*a));
+		a->size = len > ARENA_BLOCK ? len : ARENA_BLOCK;
+		a->buf = xmalloc(a->size);
+		a->len = 0;
+		a->next = *arena;
+		*arena = a;
+	}
+
+	ptr = a->buf + a->len;
+	memcpy(ptr, str, len);
+	a->len += len;
+	return ptr;
+}
+
+static void arena_free(struct arena *a) {
+
+	while(a) {
+		struct arena *next = a->next;
+
+		free(a->buf);
+		free(a);
+		a = next;
+	}
+}
+
+static void put_varint(struct buffer *b, unsigned val) {
+
+	for(; val >= 0x80; val >>= 7)
+		buffer_append_ch(b, (val & 0x7f) | 0x80);
+	buffer_append_ch(b, val);
+}
+
+/* Returns the byte after the varint, NULL if it doesn't end before 'end'. */
+static const unsigned char* get_varint(const unsigned char *p,
+				const unsigned char *end, unsigned *val) {
+
+	unsigned shift = 0;
+
+	for(*val = 0; p < end && shift < 32; shift += 7) {
+		*val |= (unsigned) (*p & 0x7f) << shift;
+		if (!(*p++ & 0x80))
+			return p;
+	}
+	return NULL;
+}
+
+static unsigned find_dest(struct dlhist *d, const char *path) {
+
+	unsigned i;
+
+	for(i=0; i < d->dest_nr; i++) {
+		if (!strcmp(d->dest[i].path, path))
+			return i;
+	}
+	return -1;
+}
+
+static unsigned add_dest(struct dlhist *d, const char *path) {
+
+	unsigned id = find_dest(d, path);
+	struct dest_info *info;
+	struct stat st;
+
+	if (id != -1)
+		return id;
+
+	d->dest = xrealloc(d->dest, sizeof(*d->dest) * (d->dest_nr + 1));
+	info = d->dest + d->dest_nr;
+	info->path = xstrdup(path);
+	info->missing = stat(path, &st) < 0;
+	if (!info->missing) {
+		info->dev = st.st_dev;
+		info->ino = st.st_ino;
+	}
+	return d->dest_nr++;
+}
+
+/* The id of 'path', safe to call while the history is shared. */
+static unsigned dest_id(struct dlhist *d, const char *path) {
+
+	unsigned id;
+
+	pthread_rwlock_rdlock(&d->dest_lock);
+	id = find_dest(d, path);
+	pthread_rwlock_unlock(&d->dest_lock);
+
+	if (id == -1) {
+		pthread_rwlock_wrlock(&d->dest_lock);
+		id = add_dest(d, path);
+		pthread_rwlock_unlock(&d->dest_lock);
+	}
+	return id;
+}
+
+/* Same directory, as file_cmp() but with the identities looked up. */
+static int dest_cmp(struct dlhist *d, unsigned a, unsigned b) {
+
+	struct dest_info *x = d->dest + a, *y = d->dest + b;
+
+	return !x->missing && !y->missing &&
+		x->dev == y->dev && x->ino == y->ino;
+}
+
+/*
+ * Next destination of 'he', read from its record if they are not
+ * loaded. Returns 0 at the end (or if the record is damaged).
+ */
+static int next_dest(struct dlhist *d, struct hash_entry *he,
+		struct dest_iter *it, struct destination *dest) {
 
-	unsigned index = hash(key) % table_size;
+	unsigned age;
+
+	if (it->i >= he->dest_nr)
+		return 0;
+
+	if (he->dest) {
+		*dest = he->dest[it->i++];
+		return 1;
+	}
+
+	it->rec = get_varint(it->rec, d->end, &dest->id);
+	if (it->rec)
+		it->rec = get_varint(it->rec, d->end, &age);
+	if (!it->rec || dest->id >= d->file_dests)
+		return 0;
+
+	dest->time = age < d->written ? d->written - age : 0;
+	it->i++;
+	return 1;
+}
+
+/* Read the destinations of 'he' from its record, to change them. */
+static void load_dests(struct dlhist *d, struct hash_entry *he) {
+
+	struct dest_iter it = DEST_ITER_INIT(he);
+	struct destination dest, *list;
+	unsigned n = 0;
+
+	if (he->dest || !he->dest_nr)
+		return;
+
+	list = xmalloc(sizeof(*list) * he->dest_nr);
+	while(next_dest(d, he, &it, &dest))
+		list[n++] = dest;
+
+	he->dest = list;
+	he->dest_nr = n;
+	he->rec = NULL;
+}
+
+static struct shard* get_shard(struct dlhist *d, const char *key) {
+
+	return d->shard + (hash(key) >> (32 - SHARD_BITS));
+}
+
+static struct hash_entry* lookup(struct shard *s, const char *key) {
+
+	unsigned index = hash(key) % s->table_size;
 
 	/* linear probing */
-	while(!he_empty(table + index)) {
-		if (!strcmp(table[index].key, key))
+	while(!he_empty(s->table + index)) {
+		if (!strcmp(s->table[index].key, key))
 			break;
-		index = (index + 1) % table_size;
+		index = (index + 1) % s->table_size;
 	}
-	return table + index;
+	return s->table + index;
 }
 
-static inline void he_set(struct hash_entry *he, const char *key) {
+static inline void he_set(struct shard *s, struct hash_entry *he,
+			const char *key) {
 
 	if (!he_empty(he))
 		return;
-	he->key = strdup(key);
-	table_count++;
+	he->key = arena_strdup(&s->arena, key);
+	s->table_count++;
 }
 
-static int he_insert(struct hash_entry *he) {
+static int he_insert(struct shard *s, struct hash_entry *he) {
 
-	struct hash_entry *dest = lookup(he->key);
+	struct hash_entry *dest = lookup(s, he->key);
 
 	if (he_empty(dest)) {
 		memcpy(dest, he, sizeof(*he));
-		table_count++;
+		s->table_count++;
 		return 1;
 	}
 	return 0;
 }
 
-static void he_remove(struct hash_entry *he) {
+/*
+ * Remove the entry in slot 'i'. The entries after it, up to the
+ * next empty slot, are moved back if that is where linear probing
+ * would find them.
+ */
+static void he_remove(struct shard *s, unsigned i) {
 
-	if (he->key) {
-		free(he->key);
-		he->key = NULL;
-	}
-	if (he->dest) {
-		int i;
-		for(i=0; i < he->dest_nr; i++)
-			free(he->dest[i].path);
-		free(he->dest);
-		he->dest = NULL;
-		he->dest_nr = 0;
+	unsigned j, home, size = s->table_size;
+
+	free(s->table[i].dest);
+	memset(s->table + i, 0, sizeof(*s->table));
+	s->table_count--;
+
+	for(j = (i + 1) % size; !he_empty(s->table + j); j = (j + 1) % size) {
+
+		home = hash(s->table[j].key) % size;
+
+		/* stays if its home is in (i, j] */
+		if (i <= j ? (home > i && home <= j) : (home > i || home <= j))
+			continue;
+
+		s->table[i] = s->table[j];
+		memset(s->table + j, 0, sizeof(*s->table));
+		i = j;
 	}
-	table_count--;
 }
 
-static int dest_insert(struct hash_entry *he, const char *path) {
+static int dest_insert(struct dlhist *d, struct hash_entry *he,
+			unsigned id, unsigned time) {
 
 	int i;
 	struct destination *dest;
 
+	load_dests(d, he);
+
 	/* Look if path already exists in entry. */
 	for(i=0; i < he->dest_nr; i++) {
 
-		if (!strcmp(he->dest[i].path, path))
+		if (he->dest[i].id == id)
 			return -1;
 	}
 
@@ -140,8 +430,8 @@ static int dest_insert(struct hash_entry *he, const char *path) {
 		sizeof(struct destination) * (he->dest_nr + 1));
 
 	dest = he->dest + he->dest_nr++;
-	dest->path = strdup(path);
-	dest->time = time(NULL);
+	dest->id = id;
+	dest->time = time;
 
 	return 0;
 }
@@ -154,22 +444,19 @@ static void dest_remove(struct hash_entry *he, unsigned index) {
 		return;
 
 	dest = he->dest + index;
-	if (dest->path)
-		free(dest->path);
-
 	memcpy(dest, he->dest + (--he->dest_nr), sizeof(*dest));
 }
 
-static void resize_table() {
+static void resize_table(struct shard *s) {
 
 	double load;
-	unsigned int i, old_size = table_size;
-	struct hash_entry *old = table;
+	unsigned int i, old_size = s->table_size;
+	struct hash_entry *old = s->table;
 
-	load = HASH_TABLE_LOAD(table_count, table_size);
+	load = HASH_TABLE_LOAD(s->table_count, s->table_size);
 
 	/* check if resize should be done */
-	if ((load < 0.5 && table_size <= TABLE_MIN_SIZE) ||
+	if ((load < 0.5 && s->table_size <= TABLE_MIN_SIZE) ||
 		(load >= 0.5 && load <= 0.75))
 		return;
 
@@ -177,75 +464,272 @@ static void resize_table() {
 	 * set size to a load factor that is in the
 	 * middle in the valid range.
 	 */
-	table_size = table_count / 0.625;
-	if (table_size < TABLE_MIN_SIZE)
-		table_size = TABLE_MIN_SIZE;
+	s->table_size = s->table_count / 0.625;
+	if (s->table_size < TABLE_MIN_SIZE)
+		s->table_size = TABLE_MIN_SIZE;
 
-	table_count = 0;
-	table = calloc(sizeof(*table), table_size);
+	s->table_count = 0;
+	s->table = calloc(sizeof(*s->table), s->table_size);
 
 	for(i=0; i < old_size; i++) {
 		struct hash_entry *he = old + i;
 		if (!he_empty(he))
-			he_insert(he);
+			he_insert(s, he);
 	}
 	free(old);
 }
 
-static void* read_entry_nr(void *buf, unsigned int *out) {
+/* Add an entry read from a file or the log, not yet in the tables. */
+static void add_entry(struct dlhist *d, struct hash_entry *he) {
+
+	struct shard *s = get_shard(d, he->key);
+
+	he_insert(s, he);
+	if (HASH_TABLE_LOAD(s->table_count, s->table_size) > 0.75)
+		resize_table(s);
+}
+
+static unsigned char* read_entry_nr(unsigned char *buf, unsigned int *out) {
 
 	memcpy(out, buf, sizeof(*out));
 	*out = ntohl(*out);
 	return buf + sizeof(*out);
 }
 
-static size_t parse_destination(char *buf, struct destination *dest) {
+static size_t parse_destination(struct dlhist *d, unsigned char *buf,
+				struct destination *dest) {
 
 	size_t offset;
 
 	buf = read_entry_nr(buf, &dest->time);
 	offset = sizeof(dest->time);
 
-	dest->path = strdup(buf);
-	return offset + strlen(buf) + 1;
+	dest->id = add_dest(d, (char *) buf);
+	return offset + strlen((char *) buf) + 1;
 }
 
-static void build_table(char *buf, size_t len) {
+/* Version 1, the titles are left where they are in the buffer. */
+static void build_table(struct dlhist *d, unsigned char *buf, size_t len) {
 
 	size_t i;
-	char *orig = buf;
-
-	table = calloc(sizeof(*table), table_size);
+	unsigned char *orig = buf;
 
 	while(buf - orig < len) {
 		unsigned dest_nr;
 		struct hash_entry entry;
 
-		entry.key = strdup(buf);
+		entry.key = (char *) buf;
+		entry.rec = NULL;
 
 		buf = read_entry_nr(buf + strlen(entry.key) + 1, &dest_nr);
 
 		entry.dest_nr = dest_nr;
 		entry.dest = calloc(sizeof(struct destination), dest_nr);
 		for(i=0; i < dest_nr; i++)
-			buf += parse_destination(buf, entry.dest + i);
+			buf += parse_destination(d, buf, entry.dest + i);
 
-		he_insert(&entry);
+		add_entry(d, &entry);
 	}
+
+	/* written in the new format on close. */
+	d->compact = 1;
 }
 
-int dlhist_open() {
+/* Sets up the entry for the title at 'off' in the records. */
+static int parse_record(struct dlhist *d, const unsigned char *rec,
+			size_t len, unsigned off, struct hash_entry *he) {
+
+	const unsigned char *ptr, *key;
 
-	char filename[4096], *buf = NULL;
-	int ret = -1, fd = -1, offset = 0;
+	if (!off || --off >= len)
+		return -1;
+
+	key = rec + off;
+	ptr = memchr(key, '\0', len - off);
+	if (!ptr)
+		return -1;
+
+	he->key = (const char *) key;
+	he->dest = NULL;
+	he->rec = get_varint(ptr + 1, d->end, &he->dest_nr);
+	return he->rec ? 0 : -1;
+}
+
+static int load_table(struct dlhist *d, unsigned char *buf, size_t len) {
+
+	struct header *hdr = (struct header *) buf;
+	unsigned char *ptr, *end = buf + len, *index, *rec;
+	unsigned i, j, shards, size;
+	int direct;
+
+	if (len < sizeof(*hdr))
+		return -1;
+
+	shards = ntohl(hdr->shards);
+	d->titles = ntohl(hdr->size);
+	d->written = ntohl(hdr->written);
+
+	ptr = buf + sizeof(*hdr);
+	for(i=0; i < ntohl(hdr->dests); i++) {
+		unsigned char *path = ptr;
+
+		ptr = memchr(ptr, '\0', end - ptr);
+		if (!ptr)
+			return -1;
+		ptr++;
+		add_dest(d, (char *) path);
+	}
+	d->file_dests = d->dest_nr;
+
+	/* The titles are after the index. The slots can be used as
+	   they are, unless the number of shards changed. */
+	direct = shards == SHARDS;
+	index = ptr;
+	for(i=0; i < shards; i++) {
+		if (end - ptr < sizeof(size))
+			return -1;
+		ptr = read_entry_nr(ptr, &size);
+		if ((end - ptr) / sizeof(size) < size)
+			return -1;
+		ptr += size * sizeof(size);
+		if (size < TABLE_MIN_SIZE)
+			direct = 0;
+	}
+	d->rec = rec = ptr;
+
+	for(ptr = index, i=0; i < shards; i++) {
+		struct shard *s = d->shard + i;
+
+		ptr = read_entry_nr(ptr, &size);
+
+		if (direct) {
+			free(s->table);
+			s->table = xmallocz(sizeof(*s->table) * size);
+			s->table_size = size;
+		}
+
+		for(j=0; j < size; j++) {
+			struct hash_entry he;
+			unsigned off;
+
+			ptr = read_entry_nr(ptr, &off);
+			if (parse_record(d, rec, end - rec, off, &he) < 0)
+				continue;
+
+			if (direct) {
+				s->table[j] = he;
+				s->table_count++;
+			} else {
+				add_entry(d, &he);
+			}
+		}
+	}
+	return 0;
+}
+
+/* Replay the marks made since the file was written. */
+static void read_log(struct dlhist *d, const char *file) {
+
+	unsigned char *buf, *ptr, *end;
+	struct stat st;
+	size_t n;
+	int fd;
+
+	fd = open(file, O_RDONLY);
+	if (fd < 0)
+		return;
+	if (fstat(fd, &st) < 0 || !st.st_size) {
+		close(fd);
+		return;
+	}
+
+	buf = malloc(st.st_size);
+	n = buf ? read(fd, buf, st.st_size) : 0;
+	close(fd);
+	if (n != st.st_size) {
+		free(buf);
+		return;
+	}
+	d->log_size = n;
+
+	for(ptr = buf, end = buf + n; ptr < end;) {
+		struct destination dest;
+		struct hash_entry *he;
+		struct shard *s;
+		char *title = (char *) ptr;
+
+		/* a record cut short by a crash is ignored */
+		ptr = memchr(ptr, '\0', end - ptr);
+		if (!ptr || end - ++ptr <= sizeof(dest.time) ||
+			!memchr(ptr + sizeof(dest.time), '\0',
+				end - ptr - sizeof(dest.time)))
+			break;
+		ptr += parse_destination(d, ptr, &dest);
+
+		s = get_shard(d, title);
+		he = lookup(s, title);
+		if (dest_insert(d, he, dest.id, dest.time) < 0)
+			continue;
+
+		he_set(s, he, title);
+		d->marks = xrealloc(d->marks,
+			sizeof(*d->marks) * (d->marks_nr + 1));
+		d->marks[d->marks_nr].key = he->key;
+		d->marks[d->marks_nr++].time = dest.time;
+
+		if (HASH_TABLE_LOAD(s->table_count, s->table_size) > 0.75)
+			resize_table(s);
+	}
+	free(buf);
+}
+
+static void dlhist_free(struct dlhist *d) {
+
+	unsigned int i, j;
+
+	for(i=0; i < SHARDS; i++) {
+		struct shard *s = d->shard + i;
+
+		for(j=0; j < s->table_size; j++)
+			free(s->table[j].dest);
+		free(s->table);
+		arena_free(s->arena);
+		buffer_free(&s->log);
+		pthread_mutex_destroy(&s->mutex);
+	}
+	for(i=0; i < d->dest_nr; i++)
+		free(d->dest[i].path);
+	free(d->dest);
+	free(d->marks);
+	free(d->buf);
+	pthread_rwlock_destroy(&d->dest_lock);
+	release_lock(&d->lock);
+	free(d);
+}
+
+struct dlhist* dlhist_open(void) {
+
+	struct lockfile lock = LOCKFILE_INIT_LOCAL;
+	char filename[4096];
+	int ret = -1, fd = -1;
+	unsigned int i, version = 0, table_size = 0;
+	struct dlhist *d;
 	struct stat st;
 	struct header *hdr;
 
+	d = xmallocz(sizeof(*d));
+	d->lock = lock;
+	pthread_rwlock_init(&d->dest_lock, NULL);
+	for(i=0; i < SHARDS; i++) {
+		pthread_mutex_init(&d->shard[i].mutex, NULL);
+		buffer_init(&d->shard[i].log);
+	}
+
 	snprintf(filename, sizeof(filename),
 		"%s/%s", env_get_dir(), STORAGE_FILE);
 
 	/* try lockin the file */
-	if (hold_lock(&lock, filename) < 0)
+	if (hold_lock(&d->lock, filename) < 0)
 		goto error;
 
 	fd = open(filename, O_CREAT | O_RDONLY, 0600);
@@ -254,194 +738,488 @@ int dlhist_open() {
 		goto error;
 	}
 
-	if (st.st_size >= sizeof(*hdr)) {
+	if (st.st_size >= HDR_SZ_V1) {
 
-		buf = malloc(st.st_size);
-		if (!buf)
+		d->buf = malloc(st.st_size);
+		if (!d->buf || read(fd, d->buf, st.st_size) != st.st_size)
 			goto error;
-
-		read(fd, buf, st.st_size);
+		d->end = d->buf + st.st_size;
 
 		/* Validate header */
-		hdr = (struct header *) buf;
+		hdr = (struct header *) d->buf;
+		version = ntohl(hdr->version);
 		if (hdr->signature != htonl(SIGNATURE) ||
-			hdr->version != htonl(1)) {
+			version < 1 || version > VERSION) {
 			error("dlhist_open: Invalid header");
 			goto error;
 		}
 
 		/* Get current table size */
-		table_size = htonl(hdr->size);
-
-		offset = sizeof(*hdr);
+		if (version < 2)
+			table_size = ntohl(hdr->size) / SHARDS;
 	}
+	d->file_size = st.st_size;
 
-	if (table_size < 1)
+	if (table_size < TABLE_MIN_SIZE)
 		table_size = TABLE_MIN_SIZE;
 
-	build_table(buf + offset, st.st_size - offset);
+	for(i=0; i < SHARDS; i++) {
+		d->shard[i].table_size = table_size;
+		d->shard[i].table = calloc(sizeof(struct hash_entry), table_size);
+	}
+
+	if (version == 1) {
+		build_table(d, d->buf + HDR_SZ_V1, st.st_size - HDR_SZ_V1);
+	} else if (version && load_table(d, d->buf, st.st_size) < 0) {
+		error("dlhist_open: file truncated");
+		goto error;
+	}
+
+	/* written in order on close. */
+	d->sorted = version != 1 && version != 2;
+	if (version == 2)
+		d->compact = 1;
+
+	snprintf(filename, sizeof(filename),
+		"%s/%s", env_get_dir(), LOG_FILE);
+	read_log(d, filename);
 
 	ret = 0;
 error:
-	if (ret)
-		release_lock(&lock);
-	if (buf)
-		free(buf);
 	if (fd >= 0)
 		close(fd);
-	return ret;
+	if (ret) {
+		dlhist_free(d);
+		return NULL;
+	}
+	return d;
 }
 
-int dlhist_lookup(const char *title, const char *dest) {
+int dlhist_lookup(struct dlhist *d, const char *title, const char *dest) {
 
+	struct shard *s = get_shard(d, title);
 	struct hash_entry *he;
+	unsigned id = dest_id(d, dest);
+	int ret = 0;
 
-	if (table_size < 1)
-		return 0;
-
-	he = lookup(title);
+	pthread_rwlock_rdlock(&d->dest_lock);
+	pthread_mutex_lock(&s->mutex);
+	he = lookup(s, title);
 	if (!he_empty(he)) {
-		int i;
-		for(i=0; i < he->dest_nr; i++) {
-
-			if (file_cmp(he->dest[i].path, dest))
-				return 1;
+		struct dest_iter it = DEST_ITER_INIT(he);
+		struct destination entry;
+
+		while(next_dest(d, he, &it, &entry)) {
+			if (dest_cmp(d, entry.id, id)) {
+				ret = 1;
+				break;
+			}
 		}
 	}
-	return 0;
+	pthread_mutex_unlock(&s->mutex);
+	pthread_rwlock_unlock(&d->dest_lock);
+	return ret;
 }
 
-void dlhist_mark(const char *title, const char *dest) {
+void dlhist_mark(struct dlhist *d, const char *title, const char *dest) {
 
+	struct shard *s = get_shard(d, title);
 	struct hash_entry *he;
+	unsigned id = dest_id(d, dest), now;
 
-	if (table_size < 1)
-		return;
+	/* taken under the lock, the shard's log is in time order. */
+	pthread_mutex_lock(&s->mutex);
+	now = time(NULL);
 
 	/* lookup a entry in the hashtable
 	   and insert the destination. */
-	he = lookup(title);
-	dest_insert(he, dest);
+	he = lookup(s, title);
+	if (!dest_insert(d, he, id, now)) {
+		unsigned t = htonl(now);
+
+		buffer_append_str(&s->log, title);
+		buffer_append_ch(&s->log, '\0');
+		buffer_append(&s->log, &t, sizeof(t));
+		buffer_append_str(&s->log, dest);
+		buffer_append_ch(&s->log, '\0');
+	}
 
 	if (he_empty(he)) {
-		he_set(he, title);
-		resize_table();
+		he_set(s, he, title);
+		resize_table(s);
+	}
+	pthread_mutex_unlock(&s->mutex);
+}
+
+/* When the oldest destination of 'he' was marked, read from 'it'. */
+static unsigned oldest_dest(struct dlhist *d, struct hash_entry *he,
+			struct dest_iter *it) {
+
+	struct destination dest;
+	unsigned oldest = -1;
+
+	while(next_dest(d, he, it, &dest)) {
+		if (dest.time < oldest)
+			oldest = dest.time;
 	}
+	return oldest;
 }
 
-void dlhist_purge(unsigned int interval) {
+/*
+ * Remove the destinations of the title in slot 'i' marked before
+ * 't'. Returns 1 if the title is removed, an entry after it may
+ * then be moved into the slot.
+ */
+static int expire(struct dlhist *d, struct shard *s, unsigned i, unsigned t) {
 
-	unsigned int i, t = time(NULL);
+	struct hash_entry *entry = s->table + i;
+	struct dest_iter it = DEST_ITER_INIT(entry);
 	int j;
 
+	if (oldest_dest(d, entry, &it) > t)
+		return 0;
+
+	load_dests(d, entry);
+	for(j=entry->dest_nr-1; j >= 0; j--) {
+
+		if (entry->dest[j].time <= t)
+			dest_remove(entry, j);
+	}
+
+	if (entry->dest_nr < 1) {
+		he_remove(s, i);
+		return 1;
+	}
+	return 0;
+}
+
+static void expire_title(struct dlhist *d, const char *key, unsigned t) {
+
+	struct shard *s = get_shard(d, key);
+	struct hash_entry *he = lookup(s, key);
+
+	if (!he_empty(he))
+		expire(d, s, he - s->table, t);
+}
+
+/* Without an order, every title is looked at. */
+static void purge_all(struct dlhist *d, unsigned t) {
+
+	unsigned int i, k;
+
+	for(k=0; k < SHARDS; k++) {
+		struct shard *s = d->shard + k;
+
+		for(i=0; i < s->table_size;) {
+			if (he_empty(s->table + i) || !expire(d, s, i, t))
+				i++;
+		}
+	}
+}
+
+/*
+ * The titles in the file are read from the oldest until one is not
+ * expired, and the same for those in the log. Those read may have
+ * been purged (or marked again) since, they are looked up in the
+ * tables. Returns how many were read.
+ */
+static unsigned purge_sorted(struct dlhist *d, unsigned t) {
+
+	const unsigned char *ptr = d->rec;
+	unsigned i, n = 0;
+
+	while(ptr < d->end) {
+		struct hash_entry he;
+		struct dest_iter it;
+
+		if (parse_record(d, ptr, d->end - ptr, 1, &he) < 0)
+			break;
+
+		/* the record ends where its last destination does */
+		it.rec = he.rec;
+		it.i = 0;
+		if (oldest_dest(d, &he, &it) > t || it.i != he.dest_nr)
+			break;
+
+		expire_title(d, he.key, t);
+		ptr = it.rec;
+		n++;
+	}
+
+	for(i=0; i < d->marks_nr && d->marks[i].time <= t; i++)
+		expire_title(d, d->marks[i].key, t);
+
+	return n + i;
+}
+
+void dlhist_purge(struct dlhist *d, unsigned int interval) {
+
+	unsigned int k, t = time(NULL);
+
 	if (t < interval)
 		return;
 
 	t -= interval;
-	for(i=0; i < table_size; i++) {
-		struct hash_entry *entry = table + i;
 
-		if (he_empty(entry))
-			continue;
+	/* until it is rewritten, the titles are read again on every purge. */
+	if (!d->sorted)
+		purge_all(d, t);
+	else if (purge_sorted(d, t) * PURGE_RATIO > d->titles + d->marks_nr)
+		d->compact = 1;
 
-		for(j=entry->dest_nr-1; j >= 0; j--) {
+	for(k=0; k < SHARDS; k++)
+		resize_table(d->shard + k);
+}
 
-			if (entry->dest[j].time <= t)
-				dest_remove(entry, j);
-		}
+struct title_ref {
+	struct hash_entry *he;
+	unsigned oldest;
+	/* where its offset goes in the index */
+	unsigned *slot;
+};
 
-		if (entry->dest_nr < 1)
-			he_remove(entry);
-	}
-	resize_table();
+static int cmp_oldest(const void *a, const void *b) {
+
+	const struct title_ref *x = a, *y = b;
+
+	if (x->oldest != y->oldest)
+		return x->oldest < y->oldest ? -1 : 1;
+	return 0;
 }
 
-static int write_dest(int fd, struct destination *dest) {
+/*
+ * Write the records of the titles, the oldest first, and the index
+ * of each shard to 'rec' and 'index'. Destinations are renumbered
+ * to those still in use, in 'map'.
+ */
+static void write_records(struct dlhist *d, struct buffer *rec,
+			struct buffer *index, unsigned *map, unsigned written,
+			unsigned titles) {
+
+	struct title_ref *ref = xmalloc(sizeof(*ref) * (titles + 1));
+	unsigned *slots[SHARDS];
+	unsigned int i, k, n = 0;
+
+	for(k=0; k < SHARDS; k++) {
+		struct shard *s = d->shard + k;
+
+		slots[k] = xmallocz(sizeof(unsigned) * s->table_size);
+		for(i=0; i < s->table_size; i++) {
+			struct hash_entry *he = s->table + i;
+			struct dest_iter it = DEST_ITER_INIT(he);
+
+			if (he_empty(he))
+				continue;
+			ref[n].he = he;
+			ref[n].oldest = oldest_dest(d, he, &it);
+			ref[n++].slot = slots[k] + i;
+		}
+	}
+	qsort(ref, n, sizeof(*ref), cmp_oldest);
 
-	unsigned time;
-	int rc, len = 0;
+	for(i=0; i < n; i++) {
+		struct hash_entry *he = ref[i].he;
+		struct dest_iter it = DEST_ITER_INIT(he);
+		struct destination dest;
 
-	time = htonl(dest->time);
-	rc = write(fd, &time, sizeof(time));
-	if (rc < 0)
-		return -1;
-	len += rc;
+		*ref[i].slot = htonl(rec->len + 1);
+		buffer_append(rec, he->key, strlen(he->key) + 1);
 
-	rc = write(fd, dest->path, strlen(dest->path) + 1);
-	if (rc < 0)
-		return -1;
+		put_varint(rec, he->dest_nr);
+		while(next_dest(d, he, &it, &dest)) {
+			unsigned age = dest.time < written ?
+				written - dest.time : 0;
+
+			put_varint(rec, map[dest.id]);
+			put_varint(rec, age);
+		}
+	}
+	free(ref);
 
-	return len + rc;
+	/* 0 for the empty slots */
+	for(k=0; k < SHARDS; k++) {
+		unsigned size = htonl(d->shard[k].table_size);
+
+		buffer_append(index, &size, sizeof(size));
+		buffer_append(index, slots[k],
+			sizeof(unsigned) * d->shard[k].table_size);
+		free(slots[k]);
+	}
 }
 
-static inline void write_int(int fd, int val) {
+/*
+ * Mark the destinations in use in 'map'. A title whose record ends
+ * early is loaded, so it has as many destinations as are written.
+ */
+static unsigned used_dests(struct dlhist *d, unsigned *map) {
+
+	unsigned int i, k, n, titles = 0;
 
-	val = htonl(val);
-	write(fd, &val, sizeof val);
+	for(k=0; k < SHARDS; k++) {
+		struct shard *s = d->shard + k;
+
+		for(i=0; i < s->table_size; i++) {
+			struct hash_entry *he = s->table + i;
+			struct dest_iter it = DEST_ITER_INIT(he);
+			struct destination dest;
+
+			if (he_empty(he))
+				continue;
+
+			for(n=0; next_dest(d, he, &it, &dest); n++)
+				map[dest.id] = 0;
+			if (n != he->dest_nr)
+				load_dests(d, he);
+			titles++;
+		}
+	}
+	return titles;
 }
 
-void dlhist_flush() {
+void dlhist_flush(struct dlhist *d) {
 
-	int i;
+	struct buffer out = BUFFER_INIT, rec = BUFFER_INIT;
+	unsigned int i, n = 0, titles, written = time(NULL), *map;
 	struct header hdr;
-	int fd = lock.fd;
+	int fd = d->lock.fd;
 
-	if (table_size < 1)
-		return;
+	/* -1 for the destinations no title uses */
+	map = xmalloc(sizeof(*map) * (d->dest_nr + 1));
+	memset(map, 0xff, sizeof(*map) * (d->dest_nr + 1));
+	titles = used_dests(d, map);
+
+	hdr.signature = htonl(SIGNATURE);
+	hdr.version = htonl(VERSION);
+	hdr.size = htonl(titles);
+	hdr.shards = htonl(SHARDS);
+	hdr.written = htonl(written);
+	buffer_append(&out, &hdr, sizeof(hdr));
+
+	for(i=0; i < d->dest_nr; i++) {
+		const char *path = d->dest[i].path;
+
+		if (map[i] == -1)
+			continue;
+		map[i] = n++;
+		buffer_append(&out, path, strlen(path) + 1);
+	}
+	((struct header *) out.block)->dests = htonl(n);
+
+	write_records(d, &rec, &out, map, written, titles);
+	free(map);
 
 	ftruncate(fd, 0);
 	lseek(fd, 0, SEEK_SET);
 
-	/* Write header */
-	hdr.signature = htonl(SIGNATURE);
-	hdr.version = htonl(1);
-	hdr.size = htonl(table_size);
+	if (write(fd, out.block, out.len) != out.len ||
+		write(fd, rec.block, rec.len) != rec.len) {
+		error("dlhist_flush: partial write");
+		goto out;
+	}
 
-	write(fd, &hdr, sizeof(hdr));
+	/* Flush it to the real file, the log is in it now. */
+	if (!commit_lock(&d->lock)) {
+		char filename[4096];
 
-	/* Write hash entries */
-	for(i=0; i < table_size; i++) {
-		int j;
-		struct hash_entry *entry = table + i;
+		snprintf(filename, sizeof(filename),
+			"%s/%s", env_get_dir(), LOG_FILE);
+		unlink(filename);
+	}
+out:
+	buffer_free(&out);
+	buffer_free(&rec);
+}
 
-		if (he_empty(entry))
-			continue;
+/* The time of the log record at 'p' (title\0, time, dest\0). */
+static unsigned record_time(const unsigned char *p) {
+
+	unsigned t;
 
-		/* write key and the number of destinations. */
-		write(fd, entry->key, strlen(entry->key) + 1);
+	p += strlen((const char *) p) + 1;
+	read_entry_nr((unsigned char *) p, &t);
+	return t;
+}
 
-		write_int(fd, entry->dest_nr);
+static size_t record_size(const unsigned char *p) {
 
-		/* write destinations for this title. */
-		for(j=0; j < entry->dest_nr; j++) {
+	size_t n = strlen((const char *) p) + 1 + sizeof(unsigned);
+
+	return n + strlen((const char *) p + n) + 1;
+}
 
-			if (write_dest(fd, entry->dest + j) < 0)
-				goto error;
+/*
+ * Append the marks of all shards, merged by time. Each shard has them
+ * in the order they were made, and the log is read back in order.
+ */
+static void write_log(struct dlhist *d) {
+
+	struct buffer out = BUFFER_INIT;
+	size_t pos[SHARDS] = { 0 };
+	char filename[4096];
+	unsigned int k;
+	size_t n;
+	int fd;
+
+	for(;;) {
+		struct buffer *log;
+		int next = -1;
+		unsigned t = 0;
+
+		for(k=0; k < SHARDS; k++) {
+			struct buffer *b = &d->shard[k].log;
+
+			if (pos[k] >= b->len)
+				continue;
+			if (next < 0 || record_time(b->block + pos[k]) < t) {
+				t = record_time(b->block + pos[k]);
+				next = k;
+			}
 		}
+		if (next < 0)
+			break;
+
+		log = &d->shard[next].log;
+		n = record_size(log->block + pos[next]);
+		buffer_append(&out, log->block + pos[next], n);
+		pos[next] += n;
 	}
 
-	/* Flush it to the real file */
-	commit_lock(&lock);
-	return;
-error:
-	error("dlhist_flush: partial write");
+	snprintf(filename, sizeof(filename),
+		"%s/%s", env_get_dir(), LOG_FILE);
+
+	fd = open(filename, O_WRONLY | O_APPEND | O_CREAT, 0600);
+	if (fd < 0) {
+		error("dlhist: %s: %s", filename, strerror(errno));
+		goto out;
+	}
+	if (write(fd, out.block, out.len) != out.len)
+		error("dlhist: %s: partial write", filename);
+	close(fd);
+out:
+	buffer_free(&out);
 }
 
-void dlhist_close() {
+void dlhist_close(struct dlhist *d) {
 
-	int i;
+	size_t pending = 0, max;
+	unsigned int k;
 
-	dlhist_flush();
+	if (!d)
+		return;
+
+	for(k=0; k < SHARDS; k++)
+		pending += d->shard[k].log.len;
 
-	release_lock(&lock);
+	max = d->file_size / LOG_RATIO;
+	if (max < LOG_MIN)
+		max = LOG_MIN;
 
-	for(i=0; i < table_count; i++)
-		he_remove(table + i);
+	if (d->compact || d->log_size + pending > max)
+		dlhist_flush(d);
+	else if (pending)
+		write_log(d);
 
-	if (table)
-		free(table);
-	table = NULL;
-	table_count = table_size = 0;
+	dlhist_free(d);
 }
 
 
@@ -455,24 +1233,30 @@ static char* strtime(time_t *time) {
 	return buf;
 }
 
-void dlhist_print() {
+void dlhist_print(struct dlhist *d) {
 
-	int i, j;
+	unsigned int i, k;
 
-	for(i=0; i < table_size; i++) {
-		struct hash_entry *entry = table + i;
+	for(k=0; k < SHARDS; k++) {
+		struct shard *s = d->shard + k;
 
-		if (he_empty(entry))
-			continue;
+		for(i=0; i < s->table_size; i++) {
+			struct hash_entry *entry = s->table + i;
+			struct dest_iter it = DEST_ITER_INIT(entry);
+			struct destination dest;
+
+			if (he_empty(entry))
+				continue;
 
-		printf("%s\n", entry->key);
+			printf("%s\n", entry->key);
 
-		for(j=0; j < entry->dest_nr; j++) {
-			struct destination *dest = entry->dest + j;
+			while(next_dest(d, entry, &it, &dest)) {
+				time_t t = dest.time;
 
-			printf("\t%s | %s\n",
-				strtime((time_t*) &dest->time), dest->path);
+				printf("\t%s | %s\n", strtime(&t),
+					d->dest[dest.id].path);
+			}
+			printf("\n");
 		}
-		printf("\n");
 	}
 }
@@ -20,18 +20,28 @@
 #ifndef DLHIST_H
 #define DLHIST_H
 
-int dlhist_open(void);
+struct dlhist;
 
-int dlhist_lookup(const char *title, const char *dest);
+/*
+ * Returns NULL if the history can't be opened (or is locked).
+ * dlhist_lookup() and dlhist_mark() may be called from several
+ * threads at once, the other functions only while no one else
+ * uses the history.
+ */
+struct dlhist* dlhist_open(void);
+
+int dlhist_lookup(struct dlhist *d, const char *title, const char *dest);
 
-void dlhist_mark(const char *title, const char *dest);
+void dlhist_mark(struct dlhist *d, const char *title, const char *dest);
 
-void dlhist_purge(unsigned int interval);
+void dlhist_purge(struct dlhist *d, unsigned int interval);
 
-void dlhist_close(void);
+/* Write the changes, if any, and release the history. */
+void dlhist_close(struct dlhist *d);
 
-void dlhist_flush(void);
+/* Rewrite the file with everything in the history. */
+void dlhist_flush(struct dlhist *d);
 
-void dlhist_print();
+void dlhist_print(struct dlhist *d);
 
 #endif /* DLHIST_H */
@@ -0,0 +1,322 @@
+/* feed-cache.c
+ *
+ *   Copyright (C) 2011       Henrik Hautakoski <henrik@fiktivkod.org>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *   MA 02110-1301, USA.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include "env.h"
+#include "error.h"
+#include "buffer.h"
+#include "lockfile.h"
+#include "xalloc.h"
+#include "feed-cache.h"
+
+/* \175 D F C */
+#define SIGNATURE 0xAF444643
+#define STORAGE_FILE "feed-cache"
+
+struct header {
+	unsigned int signature;
+	unsigned int version;
+	unsigned int entries;
+};
+
+/*
+ * Validators from the last complete response of a feed.
+ * Entries are kept sorted on url.
+ */
+struct entry {
+	char *url;
+	char *etag;
+	char *last_modified;
+	unsigned used;
+};
+
+static struct lockfile lock = LOCKFILE_INIT;
+
+static struct entry *table;
+static unsigned int table_nr;
+static unsigned int table_alloc;
+
+/* set when the table has to be written back to disk. */
+static int dirty;
+
+/* find the position of 'url' or where it should be inserted. */
+static unsigned find(const char *url, int *found) {
+
+	unsigned lo = 0, hi = table_nr;
+
+	*found = 0;
+	while(lo < hi) {
+		unsigned mid = lo + (hi - lo) / 2;
+		int cmp = strcmp(table[mid].url, url);
+
+		if (!cmp) {
+			*found = 1;
+			return mid;
+		}
+		if (cmp < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static struct entry* insert(unsigned index, const char *url) {
+
+	if (table_nr >= table_alloc) {
+		table_alloc = table_alloc ? table_alloc * 2 : 64;
+		table = xrealloc(table, sizeof(*table) * table_alloc);
+	}
+
+	memmove(table + index + 1, table + index,
+		sizeof(*table) * (table_nr - index));
+	table_nr++;
+
+	memset(table + index, 0, sizeof(*table));
+	table[index].url = xstrdup(url);
+	return table + index;
+}
+
+static void free_entry(struct entry *e) {
+
+	free(e->url);
+	free(e->etag);
+	free(e->last_modified);
+}
+
+/* empty strings are stored for missing validators. */
+static char* read_str(const char **buf, const char *end) {
+
+	const char *str = *buf;
+	size_t len = strnlen(str, end - str);
+
+	if (len == end - str)
+		return NULL;
+	*buf = str + len + 1;
+	return (char *) str;
+}
+
+static int build_table(const char *buf, size_t len, unsigned entries) {
+
+	const char *end = buf + len;
+	unsigned i;
+
+	for(i=0; i < entries; i++) {
+		const char *url, *etag, *lm;
+		struct entry *e;
+
+		url = read_str(&buf, end);
+		etag = read_str(&buf, end);
+		lm = read_str(&buf, end);
+		if (!url || !etag || !lm)
+			return -1;
+
+		/* written sorted, append. */
+		e = insert(table_nr, url);
+		if (*etag)
+			e->etag = xstrdup(etag);
+		if (*lm)
+			e->last_modified = xstrdup(lm);
+	}
+	return 0;
+}
+
+int feed_cache_open() {
+
+	char filename[4096], *buf = NULL;
+	int ret = -1, fd = -1;
+	struct stat st;
+	struct header *hdr;
+
+	snprintf(filename, sizeof(filename),
+		"%s/%s", env_get_dir(), STORAGE_FILE);
+
+	/* try lockin the file */
+	if (hold_lock(&lock, filename) < 0)
+		goto error;
+
+	fd = open(filename, O_CREAT | O_RDONLY, 0600);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		error("feed_cache_open: %s", strerror(errno));
+		goto error;
+	}
+
+	if (st.st_size >= sizeof(*hdr)) {
+
+		buf = xmalloc(st.st_size);
+
+		if (read(fd, buf, st.st_size) != st.st_size) {
+			error("feed_cache_open: %s", strerror(errno));
+			goto error;
+		}
+
+		/* Validate header */
+		hdr = (struct header *) buf;
+		if (hdr->signature != htonl(SIGNATURE) ||
+			hdr->version != htonl(1)) {
+			error("feed_cache_open: Invalid header");
+			goto error;
+		}
+
+		if (build_table(buf + sizeof(*hdr), st.st_size - sizeof(*hdr),
+			ntohl(hdr->entries)) < 0) {
+			error("feed_cache_open: file truncated");
+			goto error;
+		}
+	}
+
+	ret = 0;
+error:
+	if (ret)
+		release_lock(&lock);
+	if (buf)
+		free(buf);
+	if (fd >= 0)
+		close(fd);
+	return ret;
+}
+
+int feed_cache_lookup(const char *url, const char **etag,
+			const char **last_modified) {
+
+	int found;
+	unsigned i = find(url, &found);
+
+	*etag = *last_modified = NULL;
+	if (!found)
+		return 0;
+
+	table[i].used = 1;
+	*etag = table[i].etag;
+	*last_modified = table[i].last_modified;
+	return 1;
+}
+
+static int set_str(char **dest, const char *str) {
+
+	if (str && !*str)
+		str = NULL;
+
+	if (*dest == str || (*dest && str && !strcmp(*dest, str)))
+		return 0;
+
+	free(*dest);
+	*dest = str ? xstrdup(str) : NULL;
+	return 1;
+}
+
+void feed_cache_update(const char *url, const char *etag,
+			const char *last_modified) {
+
+	int found;
+	unsigned i = find(url, &found);
+	struct entry *e;
+
+	if (!found) {
+		/* nothing to remember. */
+		if (!etag && !last_modified)
+			return;
+		e = insert(i, url);
+		dirty = 1;
+	} else {
+		e = table + i;
+	}
+
+	e->used = 1;
+	if (set_str(&e->etag, etag))
+		dirty = 1;
+	if (set_str(&e->last_modified, last_modified))
+		dirty = 1;
+}
+
+static void append_str(struct buffer *b, const char *str) {
+
+	if (str)
+		buffer_append_str(b, str);
+	buffer_append_ch(b, '\0');
+}
+
+static int flush() {
+
+	struct buffer b = BUFFER_INIT;
+	struct header hdr = { 0 };
+	unsigned i, entries = 0;
+	int rc;
+
+	/* reserve room for the header. */
+	buffer_append(&b, &hdr, sizeof(hdr));
+
+	for(i=0; i < table_nr; i++) {
+		struct entry *e = table + i;
+
+		/* Drop feeds that are no longer in the config
+		   and feeds without validators. */
+		if (!e->used || (!e->etag && !e->last_modified))
+			continue;
+
+		append_str(&b, e->url);
+		append_str(&b, e->etag);
+		append_str(&b, e->last_modified);
+		entries++;
+	}
+
+	hdr.signature = htonl(SIGNATURE);
+	hdr.version = htonl(1);
+	hdr.entries = htonl(entries);
+	memcpy(b.block, &hdr, sizeof(hdr));
+
+	rc = write(lock.fd, b.block, b.len);
+	if (rc != b.len)
+		rc = error("feed_cache_close: %s", strerror(errno));
+
+	buffer_free(&b);
+	return rc < 0 ? -1 : 0;
+}
+
+void feed_cache_close() {
+
+	unsigned i;
+
+	if (!is_locked(&lock))
+		return;
+
+	for(i=0; i < table_nr; i++) {
+		if (!table[i].used)
+			dirty = 1;
+	}
+
+	/* Only touch the file if something changed. */
+	if (dirty && !flush())
+		commit_lock(&lock);
+	release_lock(&lock);
+
+	for(i=0; i < table_nr; i++)
+		free_entry(table + i);
+	free(table);
+	table = NULL;
+	table_nr = table_alloc = 0;
+	dirty = 0;
+}
@@ -0,0 +1,43 @@
+/* feed-cache.h
+ *
+ *   Copyright (C) 2011       Henrik Hautakoski <henrik@fiktivkod.org>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *   MA 02110-1301, USA.
+ */
+#ifndef FEED_CACHE_H
+#define FEED_CACHE_H
+
+/*
+ * Store for the HTTP validators (ETag and Last-Modified) of
+ * each target, used to make conditional requests.
+ */
+
+int feed_cache_open(void);
+
+/* Returns non-zero if 'url' is in the cache. 'etag' and
+   'last_modified' are set to NULL when missing. */
+int feed_cache_lookup(const char *url, const char **etag,
+			const char **last_modified);
+
+/* Update (or forget if both are NULL) the validators for 'url'. */
+void feed_cache_update(const char *url, const char *etag,
+			const char *last_modified);
+
+/* Write changes and release the cache. Feeds that were not
+   looked up or updated since open are dropped. */
+void feed_cache_close(void);
+
+#endif /* FEED_CACHE_H */
@@ -18,17 +18,87 @@
  *   MA 02110-1301, USA.
  */
 #include <assert.h>
+#include <ctype.h>
 #include <pcre.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include "error.h"
+#include "xalloc.h"
+#include "acauto.h"
+#include "keyword.h"
 #include "filter.h"
 
+/* JIT is only available in pcre 8.20 and later. */
+#ifdef PCRE_STUDY_JIT_COMPILE
+#define free_study(x) pcre_free_study(x)
+#else
+#define free_study(x) pcre_free(x)
+#endif
+
 struct __error_info {
 	const char *msg;
 	int offset;
 };
 
+/*
+ * Cut off runaway matches, a pattern that backtracks badly could
+ * otherwise stall the run on a single title. Sane patterns stay far
+ * below these on anything the length of a title.
+ */
+#define MATCH_LIMIT 1000000
+#define RECURSION_LIMIT 10000
+
+/* length of the subjects filter_check_backtracking() tries */
+#define PROBE_LEN 64
+/* at most this many distinct characters are used for them */
+#define PROBE_CHARS 16
+
+struct filter_regex {
+	pcre *code;
+	pcre_extra *extra;
+	/* 'extra' points here unless pcre allocated it, that is if
+	   studying found nothing or the study data was imported. */
+	pcre_extra local;
+	unsigned code_owned:1;
+	unsigned jit_tried:1;
+	unsigned limit_warned:1;
+	char *pattern;
+	/* a string every match contains, NULL if none is known. */
+	char *literal;
+	size_t literal_len;
+};
+
+struct keyword_ref {
+	unsigned term;
+	unsigned index;
+};
+
+struct filter_set {
+	struct filter_regex **regex;
+	unsigned nr;
+	struct acauto *ac;
+	/* patterns without a literal, always run. */
+	unsigned *always;
+	unsigned always_nr;
+	/* candidates of the current subject. */
+	unsigned *mark;
+	unsigned gen;
+	unsigned *cand;
+	unsigned cand_nr;
+	unsigned *match;
+	/* keyword filters, their id in 'ks' or -1. */
+	struct keyword_set *ks;
+	int *keyword;
+	/* the keyword filters by the alternatives of their
+	   first term, sorted by term. */
+	struct keyword_ref *ref;
+	unsigned ref_nr;
+	/* per pattern statistics, if profiling. */
+	struct filter_stats *stats;
+};
+
 static inline pcre* compile(const char *pattern, struct __error_info *info) {
 
 	const char *err;
@@ -47,54 +117,649 @@ static inline pcre* compile(const char *pattern, struct __error_info *info) {
 	return regex;
 }
 
-static inline int match(pcre *pcre, const char *subject) {
+/*
+ * Returns a pointer past the quantifier at 'p' (if any), 'optional'
+ * is set if it allows zero repetitions.
+ */
+static const char* skip_quantifier(const char *p, int *optional) {
+
+	const char *it;
+
+	*optional = 0;
+
+	switch(*p) {
+	case '?':
+	case '*':
+		*optional = 1;
+		/* fall through */
+	case '+':
+		p++;
+		break;
+	case '{':
+		/* "{n}", "{n,}" or "{n,m}", anything else is literal. */
+		for(it = p + 1; isdigit(*it); it++);
+		if (it == p + 1)
+			return p;
+		if (*it == ',')
+			for(it++; isdigit(*it); it++);
+		if (*it != '}')
+			return p;
+		*optional = atoi(p + 1) == 0;
+		p = it + 1;
+		break;
+	default:
+		return p;
+	}
+
+	/* lazy or possessive */
+	if (*p == '?' || *p == '+')
+		p++;
+	return p;
+}
+
+static const char* skip_class(const char *p) {
+
+	/* p is past '[' */
+	if (*p == '^')
+		p++;
+	if (*p == ']')
+		p++;
+
+	for(; *p && *p != ']'; p++) {
+		if (*p == '\\' && p[1]) {
+			p++;
+		} else if (p[0] == '[' && p[1] == ':') {
+			const char *end = strstr(p + 2, ":]");
+			if (end)
+				p = end + 1;
+		}
+	}
+	return *p ? p + 1 : p;
+}
+
+static const char* skip_group(const char *p) {
+
+	unsigned depth = 1;
+
+	/* p is past '(' */
+	while(*p && depth) {
+		if (*p == '\\' && p[1]) {
+			p += 2;
+		} else if (*p == '[') {
+			p = skip_class(p + 1);
+		} else {
+			if (*p == '(')
+				depth++;
+			else if (*p == ')')
+				depth--;
+			p++;
+		}
+	}
+	return p;
+}
+
+/*
+ * Find the longest string of literal characters that any match of
+ * 'pattern' must contain. Only simple sequences are looked at, groups
+ * and classes are skipped over. Gives up (returns 0) on anything that
+ * could change the meaning of the characters around it, such as
+ * alternation at the top level, option settings and quoting.
+ */
+static size_t required_literal(const char *pattern, char *buf) {
+
+	/* escapes that match one of a set of characters, or nothing. */
+	static const char *types = "dDsSwWbBAzZGhHvVRXC";
+	const char *p = pattern;
+	size_t len = 0, best = 0, start = 0;
+	int optional;
 
-	int ovector[1];
+	while(*p) {
+		const char *q;
+		char ch;
 
-	return pcre_exec(pcre, NULL, subject, strlen(subject), 0, 0,
-		ovector, sizeof(ovector));
+		switch(*p) {
+		case '|':
+			return 0;
+		case '(':
+			/* options, verbs and the like */
+			if ((p[1] == '?' && (isalpha(p[2]) || p[2] == '-' ||
+				p[2] == '#')) || p[1] == '*')
+				return 0;
+			p = skip_quantifier(skip_group(p + 1), &optional);
+			goto end_run;
+		case '[':
+			p = skip_quantifier(skip_class(p + 1), &optional);
+			goto end_run;
+		case '.':
+		case '^':
+		case '$':
+			p = skip_quantifier(p + 1, &optional);
+			goto end_run;
+		case '\\':
+			if (!p[1])
+				return 0;
+			if (isalnum(p[1])) {
+				if (!strchr(types, p[1]))
+					return 0;
+				p = skip_quantifier(p + 2, &optional);
+				goto end_run;
+			}
+			ch = p[1];
+			q = p + 2;
+			break;
+		default:
+			ch = *p;
+			q = p + 1;
+			break;
+		}
+
+		/* a literal character */
+		p = skip_quantifier(q, &optional);
+		if (!optional)
+			buf[start + len++] = ch;
+		if (p == q)
+			continue;
+end_run:
+		if (len > best) {
+			memmove(buf, buf + start, len);
+			best = len;
+			start = best;
+		}
+		len = 0;
+	}
+
+	if (len > best) {
+		memmove(buf, buf + start, len);
+		best = len;
+	}
+	return best;
+}
+
+static void set_limits(struct filter_regex *regex) {
+
+	if (!regex->extra)
+		regex->extra = &regex->local;
+
+	regex->extra->flags |= PCRE_EXTRA_MATCH_LIMIT |
+		PCRE_EXTRA_MATCH_LIMIT_RECURSION;
+	regex->extra->match_limit = MATCH_LIMIT;
+	regex->extra->match_limit_recursion = RECURSION_LIMIT;
+}
+
+/*
+ * Patterns are JIT compiled the first time they are run, most of them
+ * never are since their literal isn't found. Compiled code can't be
+ * stored, so this is also what makes imported patterns fast.
+ */
+static void jit_compile(struct filter_regex *regex) {
+
+#ifdef PCRE_STUDY_JIT_COMPILE
+	const char *err;
+	pcre_extra *extra;
+	int jit = 0;
+
+	regex->jit_tried = 1;
+
+	extra = pcre_study(regex->code, PCRE_STUDY_JIT_COMPILE, &err);
+	if (!extra)
+		return;
+	if (pcre_fullinfo(regex->code, extra, PCRE_INFO_JIT, &jit) || !jit) {
+		free_study(extra);
+		return;
+	}
+
+	if (regex->extra != &regex->local)
+		free_study(regex->extra);
+	regex->extra = extra;
+	set_limits(regex);
+#else
+	regex->jit_tried = 1;
+#endif
+}
+
+#ifdef PCRE_ERROR_JIT_STACKLIMIT
+#define is_limit(rc) ((rc) == PCRE_ERROR_MATCHLIMIT || \
+	(rc) == PCRE_ERROR_RECURSIONLIMIT || (rc) == PCRE_ERROR_JIT_STACKLIMIT)
+#else
+#define is_limit(rc) ((rc) == PCRE_ERROR_MATCHLIMIT || \
+	(rc) == PCRE_ERROR_RECURSIONLIMIT)
+#endif
+
+/*
+ * Returns the result of pcre_exec(), a match cut off by the limits
+ * counts as no match and is reported (once per pattern).
+ */
+static inline int match(struct filter_regex *regex, const char *subject,
+			size_t len) {
+
+	int ovector[3], rc;
+
+	if (!regex->jit_tried)
+		jit_compile(regex);
+
+	rc = pcre_exec(regex->code, regex->extra, subject, len, 0, 0,
+		ovector, sizeof(ovector) / sizeof(*ovector));
+
+	if (is_limit(rc) && !regex->limit_warned) {
+		regex->limit_warned = 1;
+		warn("filter: '%s' gave up on '%.*s' (match limit), "
+			"it does not match", regex->pattern, (int) len, subject);
+	}
+	return rc;
 }
 
 int filter_check_syntax(const char *pattern) {
 
 	struct __error_info info;
+	pcre *regex;
 
-	if (!compile(pattern, &info)) {
+	regex = compile(pattern, &info);
+	if (!regex) {
 		error("filter: error in expression '%s': %s\n",
 			pattern, info.msg);
 		return 0;
 	}
+	pcre_free(regex);
 	return 1;
 }
 
-int filter_match(const char *pattern, const char *subject) {
+static struct filter_regex* new_regex(const char *pattern, pcre *code) {
 
-	pcre *regex;
-	int rc;
+	struct filter_regex *regex = xmallocz(sizeof(*regex));
 
-	if (!pattern || !subject)
-		return 0;
+	regex->code = code;
+	regex->pattern = xstrdup(pattern);
+	regex->literal = xmalloc(strlen(pattern) + 1);
+	regex->literal_len = required_literal(pattern, regex->literal);
+	if (!regex->literal_len) {
+		free(regex->literal);
+		regex->literal = NULL;
+	}
+	return regex;
+}
+
+struct filter_regex* filter_compile(const char *pattern) {
+
+	struct filter_regex *regex;
+	const char *err;
+	pcre *code;
+
+	if (!pattern)
+		return NULL;
+
+	code = compile(pattern, NULL);
+	if (!code)
+		return NULL;
 
-	regex = compile(pattern, NULL);
+	regex = new_regex(pattern, code);
+	regex->code_owned = 1;
+	/* NULL if studying found nothing useful, which is fine. */
+	regex->extra = pcre_study(code, 0, &err);
+	set_limits(regex);
+
+	return regex;
+}
+
+/* characters to build subjects from, besides those in the pattern. */
+static const char probe_chars[] = "a0 ";
+
+static int probe(struct filter_regex *regex, const char *subject) {
+
+	int ovector[3];
+	int rc = pcre_exec(regex->code, regex->extra, subject, strlen(subject),
+		0, 0, ovector, sizeof(ovector) / sizeof(*ovector));
+
+	return is_limit(rc);
+}
+
+/*
+ * Patterns that backtrack catastrophically do so on a run of the same
+ * few characters that fails to match at the very end. Try runs of
+ * every character (and pair of characters) the pattern mentions,
+ * ended by one it doesn't.
+ */
+int filter_check_backtracking(const char *pattern) {
+
+	struct filter_regex *regex;
+	char chars[PROBE_CHARS], subject[PROBE_LEN + 2];
+	unsigned nr = 0, i, j, k;
+	const char *p;
+	int ret = 0;
+
+	regex = filter_compile(pattern);
 	if (!regex)
 		return 0;
 
-	rc = match(regex, subject);
+	for(p = probe_chars; *p; p++)
+		chars[nr++] = *p;
+	for(p = pattern; *p && nr < PROBE_CHARS; p++) {
+		/* \d, \w and \s are covered by the probe characters. */
+		if (*p == '\\' && p[1]) {
+			if (strchr("dwsDWS", *++p))
+				continue;
+		} else if (strchr("^$.|?*+()[]{}", *p)) {
+			continue;
+		}
+		if ((unsigned char) *p < 0x20 || memchr(chars, *p, nr))
+			continue;
+		chars[nr++] = *p;
+	}
 
-	pcre_free(regex);
+	for(i=0; i < nr && !ret; i++) {
+		for(j=i; j < nr && !ret; j++) {
+			for(k=0; k < PROBE_LEN; k++)
+				subject[k] = k % 2 ? chars[j] : chars[i];
+			subject[PROBE_LEN] = '\001';
+			subject[PROBE_LEN + 1] = '\0';
+			ret = probe(regex, subject);
+		}
+	}
+
+	filter_free(regex);
+	return ret;
+}
+
+const char* filter_engine_version(void) {
 
-	return rc > 0;
+	return pcre_version();
 }
 
-int filter_match_list(char **patterns, unsigned n, const char *subject) {
+int filter_export(struct filter_regex *regex, const void **code,
+		size_t *code_size, const void **study, size_t *study_size) {
+
+	size_t size;
 
-	int i;
+	if (pcre_fullinfo(regex->code, NULL, PCRE_INFO_SIZE, &size))
+		return -1;
+	*code = regex->code;
+	*code_size = size;
+
+	*study = NULL;
+	*study_size = 0;
+	if (regex->extra && (regex->extra->flags & PCRE_EXTRA_STUDY_DATA) &&
+		!pcre_fullinfo(regex->code, regex->extra,
+			PCRE_INFO_STUDYSIZE, &size)) {
+		*study = regex->extra->study_data;
+		*study_size = size;
+	}
+	return 0;
+}
+
+struct filter_regex* filter_import(const char *pattern, const void *code,
+			const void *study) {
+
+	struct filter_regex *regex;
+	size_t size;
+
+	/* fails on bytecode from a host with another byte order. */
+	if (pcre_fullinfo(code, NULL, PCRE_INFO_SIZE, &size))
+		return filter_compile(pattern);
+
+	regex = new_regex(pattern, (pcre *) code);
+	if (study) {
+		regex->local.flags = PCRE_EXTRA_STUDY_DATA;
+		regex->local.study_data = (void *) study;
+	}
+	set_limits(regex);
+	return regex;
+}
+
+void filter_free(struct filter_regex *regex) {
+
+	if (!regex)
+		return;
+	if (regex->extra != &regex->local)
+		free_study(regex->extra);
+	if (regex->code_owned)
+		pcre_free(regex->code);
+	free(regex->pattern);
+	free(regex->literal);
+	free(regex);
+}
+
+int filter_match(struct filter_regex *regex, const char *subject, size_t len) {
+
+	if (!regex || !subject)
+		return 0;
+
+	return match(regex, subject, len) > 0;
+}
+
+struct filter_set* filter_set_new(struct filter_regex **regex, unsigned n) {
+
+	struct filter_set *set = xmallocz(sizeof(*set));
+	unsigned i;
+
+	set->regex = xmemdup(regex, sizeof(*regex) * (n ? n : 1));
+	set->nr = n;
+	set->ac = acauto_new();
+	set->always = xmalloc(sizeof(*set->always) * (n ? n : 1));
+	set->mark = xmallocz(sizeof(*set->mark) * (n ? n : 1));
+	set->cand = xmalloc(sizeof(*set->cand) * (n ? n : 1));
+	set->match = xmalloc(sizeof(*set->match) * (n ? n : 1));
 
 	for(i=0; i < n; i++) {
+		if (!regex[i])
+			continue;
+		if (regex[i]->literal)
+			acauto_add(set->ac, regex[i]->literal,
+				regex[i]->literal_len, i);
+		else
+			set->always[set->always_nr++] = i;
+	}
+	acauto_build(set->ac);
+
+	return set;
+}
+
+void filter_set_free(struct filter_set *set) {
 
-		/* return true at the first matching pattern */
-		if (filter_match(patterns[i], subject))
-			return 1;
+	if (!set)
+		return;
+	acauto_free(set->ac);
+	free(set->regex);
+	free(set->always);
+	free(set->mark);
+	free(set->cand);
+	free(set->match);
+	free(set->keyword);
+	free(set->ref);
+	free(set);
+}
+
+static int cmp_ref(const void *a, const void *b) {
+
+	const struct keyword_ref *x = a, *y = b;
+
+	if (x->term != y->term)
+		return x->term < y->term ? -1 : 1;
+	return x->index < y->index ? -1 : x->index > y->index;
+}
+
+void filter_set_keywords(struct filter_set *set, struct keyword_set *ks,
+			const int *id) {
+
+	unsigned i, j, n;
+
+	set->ks = ks;
+	set->keyword = xmemdup(id, sizeof(*id) * (set->nr ? set->nr : 1));
+
+	for(i=0; i < set->nr; i++) {
+		const int *term;
+
+		if (id[i] < 0)
+			continue;
+		n = keyword_set_first(ks, id[i], &term);
+		set->ref = xrealloc(set->ref,
+			sizeof(*set->ref) * (set->ref_nr + n));
+		for(j=0; j < n; j++) {
+			set->ref[set->ref_nr].term = term[j];
+			set->ref[set->ref_nr++].index = i;
+		}
 	}
+	qsort(set->ref, set->ref_nr, sizeof(*set->ref), cmp_ref);
+}
+
+void filter_set_profile(struct filter_set *set, struct filter_stats *stats) {
+
+	set->stats = stats;
+}
+
+static inline unsigned long long now(void) {
+
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void record(struct filter_set *set, unsigned i, int rc,
+			unsigned long long start) {
+
+	struct filter_stats *st = set->stats + i;
+	unsigned long long t = now() - start;
+
+	st->evals++;
+	if (rc > 0)
+		st->matches++;
+	else if (is_limit(rc))
+		st->aborted++;
+	st->total += t;
+	if (t > st->max)
+		st->max = t;
+}
+
+/* Run pattern 'i' of the set, keyword filters are decided already. */
+static int run(struct filter_set *set, unsigned i, const char *subject,
+			size_t len) {
+
+	unsigned long long start;
+	int ret;
+
+	if (!set->regex[i])
+		return 1;
+	if (!set->stats)
+		return match(set->regex[i], subject, len) > 0;
+
+	start = now();
+	ret = match(set->regex[i], subject, len);
+	record(set, i, ret, start);
+	return ret > 0;
+}
+
+static int keyword_matched(struct filter_set *set, unsigned i) {
+
+	unsigned long long start;
+	int ret;
+
+	if (!set->stats)
+		return keyword_set_matched(set->ks, set->keyword[i]);
+
+	start = now();
+	ret = keyword_set_matched(set->ks, set->keyword[i]);
+	record(set, i, ret, start);
+	return ret;
+}
+
+static void add_candidate(struct filter_set *set, unsigned i) {
+
+	if (set->mark[i] == set->gen)
+		return;
+	set->mark[i] = set->gen;
+	set->cand[set->cand_nr++] = i;
+}
+
+static int found_literal(unsigned id, void *data) {
+
+	add_candidate(data, id);
 	return 0;
 }
+
+/*
+ * The keyword filters that have 'term' as an alternative of their
+ * first term are checked. Only they can match, whatever else is found.
+ */
+static void keyword_candidates(struct filter_set *set, unsigned term) {
+
+	unsigned lo = 0, hi = set->ref_nr;
+
+	/* the first reference to 'term' */
+	while(lo < hi) {
+		unsigned mid = lo + (hi - lo) / 2;
+
+		if (set->ref[mid].term < term)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	for(; lo < set->ref_nr && set->ref[lo].term == term; lo++) {
+		unsigned i = set->ref[lo].index;
+
+		if (set->mark[i] != set->gen && keyword_matched(set, i))
+			add_candidate(set, i);
+	}
+}
+
+static int cmp_index(const void *a, const void *b) {
+
+	unsigned x = *(const unsigned *) a, y = *(const unsigned *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+static unsigned set_match(struct filter_set *set, const char *subject,
+			size_t len, unsigned max) {
+
+	unsigned i, n = 0;
+
+	if (!subject)
+		return 0;
+
+	/* new generation of marks, reset them when it wraps. */
+	if (!++set->gen) {
+		memset(set->mark, 0, sizeof(*set->mark) * set->nr);
+		set->gen = 1;
+	}
+	set->cand_nr = 0;
+
+	acauto_scan(set->ac, subject, len, found_literal, set);
+	for(i=0; i < set->always_nr; i++)
+		add_candidate(set, set->always[i]);
+
+	/* keyword filters are decided by the scan alone. */
+	if (set->ks && set->ref_nr) {
+		const unsigned *term;
+		unsigned nr;
+
+		keyword_set_scan(set->ks, subject, len);
+		nr = keyword_set_found(set->ks, &term);
+		for(i=0; i < nr; i++)
+			keyword_candidates(set, term[i]);
+	}
+
+	qsort(set->cand, set->cand_nr, sizeof(*set->cand), cmp_index);
+
+	for(i=0; i < set->cand_nr && n < max; i++) {
+		unsigned c = set->cand[i];
+
+		if (run(set, c, subject, len))
+			set->match[n++] = c;
+	}
+	return n;
+}
+
+unsigned filter_set_match(struct filter_set *set, const char *subject,
+			size_t len, const unsigned **match) {
+
+	unsigned n = set_match(set, subject, len, set->nr);
+
+	*match = set->match;
+	return n;
+}
+
+int filter_match_list(struct filter_set *set, const char *subject, size_t len) {
+
+	/* stop at the first matching pattern */
+	return set_match(set, subject, len, 1) > 0;
+}
@@ -20,10 +20,105 @@
 #ifndef FILTER_H
 #define FILTER_H
 
+#include <stddef.h>
+
+/* a compiled pattern. */
+struct filter_regex;
+
 int filter_check_syntax(const char *pattern);
 
-int filter_match(const char *pattern, const char *subject);
+/*
+ * Returns non-zero if 'pattern' runs into the match limit on a short
+ * synthetic subject, it backtracks so badly that it is likely to be
+ * cut off (and not match) on real titles as well.
+ */
+int filter_check_backtracking(const char *pattern);
+
+/*
+ * Compile 'pattern' for matching, returns NULL if it is not a valid
+ * expression. The pattern is studied, and JIT compiled the first time
+ * it is run if pcre supports it, so compile each pattern once and keep
+ * the handle. Matches that exceed the match limit fail.
+ */
+struct filter_regex* filter_compile(const char *pattern);
+
+void filter_free(struct filter_regex *regex);
+
+/*
+ * Compiled patterns can be stored and loaded again. The bytecode is in
+ * host byte order and tied to the pcre version, so store
+ * filter_engine_version() along with it.
+ */
+const char* filter_engine_version(void);
+
+/* The pointers are valid as long as the handle. 'study' may be NULL. */
+int filter_export(struct filter_regex *regex, const void **code,
+		size_t *code_size, const void **study, size_t *study_size);
+
+/*
+ * Wrap stored bytecode (and study data, if any) in a handle without
+ * copying it. 'pattern' is compiled instead if the bytecode can't be
+ * used.
+ */
+struct filter_regex* filter_import(const char *pattern, const void *code,
+			const void *study);
+
+/* 'len' is the length of 'subject' */
+int filter_match(struct filter_regex *regex, const char *subject, size_t len);
+
+/*
+ * A set of patterns matched together. Every pattern has a literal
+ * that any match must contain extracted, all of them are searched for
+ * in one pass and only the patterns whose literal was found (or that
+ * have none) are run. The cost per subject follows its length rather
+ * than the number of patterns.
+ *
+ * 'regex' may contain NULL entries, they never match. The handles
+ * must outlive the set. A set is not reentrant.
+ */
+struct filter_set;
+
+struct filter_set* filter_set_new(struct filter_regex **regex, unsigned n);
+
+void filter_set_free(struct filter_set *set);
+
+/*
+ * Add keyword filters to the set, 'id' holds for every pattern its id
+ * in 'ks' or -1 if it is a regular expression. The entry in 'regex'
+ * of a keyword filter must be NULL. 'ks' must outlive the set.
+ */
+struct keyword_set;
+
+void filter_set_keywords(struct filter_set *set, struct keyword_set *ks,
+			const int *id);
+
+/*
+ * Returns the number of patterns matching 'subject', their indexes
+ * are stored in ascending order in 'match', which is valid until the
+ * next call.
+ */
+unsigned filter_set_match(struct filter_set *set, const char *subject,
+			size_t len, const unsigned **match);
+
+/*
+ * Match statistics of a pattern in a set. A pattern is evaluated only
+ * if its literal was found in the subject (or it has none), time is
+ * in nanoseconds.
+ */
+struct filter_stats {
+	unsigned long evals;
+	unsigned long matches;
+	/* evaluations cut off by the match limit. */
+	unsigned long aborted;
+	unsigned long long total;
+	unsigned long long max;
+};
+
+/* Collect statistics into 'stats', one entry per pattern of the set,
+   NULL turns it off. The caller zeroes it. */
+void filter_set_profile(struct filter_set *set, struct filter_stats *stats);
 
-int filter_match_list(char **patterns, unsigned n, const char *subject);
+/* Returns non-zero if any pattern in the set matches. */
+int filter_match_list(struct filter_set *set, const char *subject, size_t len);
 
 #endif /* FILTER_H */
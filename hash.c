@@ -33,6 +33,96 @@ hash_t hash_sdbm(const char *s) {
         return h;
 }
 
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+
+#define rotl64(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+/* reads are little endian, as the reference implementation. */
+static inline uint64_t read64(const unsigned char *p) {
+
+	return (uint64_t) p[0] | (uint64_t) p[1] << 8 |
+		(uint64_t) p[2] << 16 | (uint64_t) p[3] << 24 |
+		(uint64_t) p[4] << 32 | (uint64_t) p[5] << 40 |
+		(uint64_t) p[6] << 48 | (uint64_t) p[7] << 56;
+}
+
+static inline uint32_t read32(const unsigned char *p) {
+
+	return (uint32_t) p[0] | (uint32_t) p[1] << 8 |
+		(uint32_t) p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+static inline uint64_t xxh_round(uint64_t acc, uint64_t input) {
+
+	acc += input * PRIME64_2;
+	acc = rotl64(acc, 31);
+	return acc * PRIME64_1;
+}
+
+static inline uint64_t xxh_merge(uint64_t acc, uint64_t val) {
+
+	acc ^= xxh_round(0, val);
+	return acc * PRIME64_1 + PRIME64_4;
+}
+
+uint64_t hash_xxh64(const void *data, size_t len, uint64_t seed) {
+
+	const unsigned char *p = data, *end = p + len;
+	uint64_t h;
+
+	if (len >= 32) {
+		const unsigned char *limit = end - 32;
+		uint64_t v1 = seed + PRIME64_1 + PRIME64_2;
+		uint64_t v2 = seed + PRIME64_2;
+		uint64_t v3 = seed;
+		uint64_t v4 = seed - PRIME64_1;
+
+		do {
+			v1 = xxh_round(v1, read64(p));
+			v2 = xxh_round(v2, read64(p + 8));
+			v3 = xxh_round(v3, read64(p + 16));
+			v4 = xxh_round(v4, read64(p + 24));
+			p += 32;
+		} while(p <= limit);
+
+		h = rotl64(v1, 1) + rotl64(v2, 7) +
+			rotl64(v3, 12) + rotl64(v4, 18);
+		h = xxh_merge(h, v1);
+		h = xxh_merge(h, v2);
+		h = xxh_merge(h, v3);
+		h = xxh_merge(h, v4);
+	} else {
+		h = seed + PRIME64_5;
+	}
+
+	h += (uint64_t) len;
+
+	for(; p + 8 <= end; p += 8) {
+		h ^= xxh_round(0, read64(p));
+		h = rotl64(h, 27) * PRIME64_1 + PRIME64_4;
+	}
+	if (p + 4 <= end) {
+		h ^= (uint64_t) read32(p) * PRIME64_1;
+		h = rotl64(h, 23) * PRIME64_2 + PRIME64_3;
+		p += 4;
+	}
+	for(; p < end; p++) {
+		h ^= *p * PRIME64_5;
+		h = rotl64(h, 11) * PRIME64_1;
+	}
+
+	h ^= h >> 33;
+	h *= PRIME64_2;
+	h ^= h >> 29;
+	h *= PRIME64_3;
+	h ^= h >> 32;
+	return h;
+}
+
 void hash_init(struct hash_table *table) {
 
 	table->ptr = NULL;
@@ -84,8 +174,12 @@ static unsigned needs_resize(const struct hash_table *t) {
 
 	if (t->size) {
 		double load = t->count / ((double) t->size);
-		return ((load >= 0.5 && load <= 0.75) == 0) &&
-			(t->size > TABLE_MIN_SIZE);
+
+		/* never shrink below the minimum size, but always
+		   grow, a full table would make lookup() spin. */
+		if (load > 0.75)
+			return 1;
+		return load < 0.5 && t->size > TABLE_MIN_SIZE;
 	}
 	return 1;
 }
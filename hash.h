@@ -21,6 +21,7 @@
 #define HASH_H
 
 #include <stddef.h>
+#include <stdint.h>
 
 typedef unsigned int hash_t;
 
@@ -38,6 +39,9 @@ struct hash_table {
 /* general hash functions */
 hash_t hash_sdbm(const char *s);
 
+/* XXH64, a fast 64-bit hash (not for cryptographic use) */
+uint64_t hash_xxh64(const void *data, size_t len, uint64_t seed);
+
 void hash_init(struct hash_table *table);
 
 void hash_free(struct hash_table *table);
@@ -20,19 +20,17 @@
 #include <curl/curl.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <ctype.h>
 #include <unistd.h>
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include "error.h"
+#include "xalloc.h"
 #include "http.h"
 
-struct http_file_req {
-	char *filename;
-	FILE *fd;
-};
-
 static char* strnstrr(const char *str, const char *needle, size_t size) {
 
 	char *ptr;
@@ -97,6 +95,45 @@ static size_t hdr_fname_cb(void *src, size_t smemb, size_t nmemb, void *data) {
 	return size;
 }
 
+#define HDR_ETAG "ETag:"
+#define HDR_LASTMOD "Last-Modified:"
+
+static char* hdr_value(const char *ptr, size_t size, const char *name) {
+
+	size_t len = strlen(name);
+
+	if (size < len || strncasecmp(ptr, name, len))
+		return NULL;
+
+	for(ptr += len, size -= len; size && isblank(*ptr); size--)
+		ptr++;
+	while(size && isspace(ptr[size-1]))
+		size--;
+
+	return size ? strndup(ptr, size) : NULL;
+}
+
+static size_t hdr_validator_cb(void *src, size_t smemb, size_t nmemb, void *data) {
+
+	size_t size = smemb * nmemb;
+	struct http_page *page = data;
+	char *val;
+
+	if (size > 5 && !memcmp(src, "HTTP/", 5)) {
+		/* new response (redirect), forget the previous one. */
+		free(page->etag);
+		free(page->last_modified);
+		page->etag = page->last_modified = NULL;
+	} else if ((val = hdr_value(src, size, HDR_ETAG))) {
+		free(page->etag);
+		page->etag = val;
+	} else if ((val = hdr_value(src, size, HDR_LASTMOD))) {
+		free(page->last_modified);
+		page->last_modified = val;
+	}
+	return size;
+}
+
 static size_t write_cb(void *src, size_t smemb, size_t nmemb, void *data) {
 
 	size_t size = smemb * nmemb;
@@ -106,146 +143,573 @@ static size_t write_cb(void *src, size_t smemb, size_t nmemb, void *data) {
 	return size;
 }
 
-#define HTTPREQ_MEM	0
-#define HTTPREQ_FILE	1
-#define HTTPREQ_FILEMEM 2
+#define TMPFILE_TEMPLATE ".dlight-XXXXXX"
 
-static int http_request(const char *url, void *req, int mode) {
+static int make_tmpfile(const char *dir, char *path, size_t size) {
 
-	CURL *handle;
-	CURLcode res;
-	int ret = 0;
-	void *headerdata = NULL;
+	int fd;
+	mode_t mask;
 
-	handle = curl_easy_init();
+	if (snprintf(path, size, "%s/%s", dir, TMPFILE_TEMPLATE) >= size) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	fd = mkstemp(path);
+	if (fd < 0)
+		return -1;
+
+	/* mkstemp() creates the file 0600, use the same
+	   permissions as a regular file created by us. */
+	mask = umask(0);
+	umask(mask);
+	fchmod(fd, 0664 & ~mask);
+	return fd;
+}
+
+/*
+ * Create the temporary file that receives the payload of 'file'.
+ * It is put in 'dir' so it can later be linked into place there
+ * without copying.
+ */
+static int open_file(struct http_file *file, const char *dir) {
+
+	char path[4096];
+	int fd;
+
+	fd = make_tmpfile(dir, path, sizeof(path));
+	if (fd < 0)
+		return -1;
+
+	file->fd = fdopen(fd, "w");
+	if (!file->fd) {
+		close(fd);
+		unlink(path);
+		return -1;
+	}
+	file->path = xstrdup(path);
+	return 0;
+}
+
+static int close_file(struct http_file *file) {
+
+	int rc = 0;
+
+	if (file->fd) {
+		rc = fclose(file->fd);
+		file->fd = NULL;
+	}
+	return rc;
+}
+
+#define CONNECT_TIMEOUT 10
+#define PAGE_TIMEOUT 10
+
+/* files can be large, a transfer is only given up when it is
+   slower than LOW_SPEED_LIMIT bytes/s for LOW_SPEED_TIME seconds. */
+#define LOW_SPEED_LIMIT 1024
+#define LOW_SPEED_TIME 60
+
+static void setup_handle(CURL *handle, const char *url) {
 
 	curl_easy_setopt(handle, CURLOPT_URL, url);
 	curl_easy_setopt(handle, CURLOPT_USERAGENT, "libcurl-agent/1.0");
 	curl_easy_setopt(handle, CURLOPT_SSL_VERIFYHOST, 0);
 	curl_easy_setopt(handle, CURLOPT_SSL_VERIFYPEER, 0);
-	curl_easy_setopt(handle, CURLOPT_TIMEOUT, 10);
+	curl_easy_setopt(handle, CURLOPT_CONNECTTIMEOUT, CONNECT_TIMEOUT);
+}
 
-	if (mode == HTTPREQ_FILE) {
-		struct http_file_req *freq = req;
+static int copy_file(const char *src, int dst) {
 
-		curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, fwrite);
-		curl_easy_setopt(handle, CURLOPT_WRITEDATA, freq->fd);
+	char buf[65536];
+	ssize_t len;
+	int fd = open(src, O_RDONLY);
 
-		headerdata = &freq->filename;
-	} else {
-		curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, write_cb);
-		if (mode == HTTPREQ_FILEMEM) {
-			struct http_file *file = req;
+	if (fd < 0)
+		return -1;
 
-			req = &file->data;
-			headerdata = &file->filename;
+	while((len = read(fd, buf, sizeof(buf))) > 0) {
+		if (write(dst, buf, len) != len) {
+			len = -1;
+			break;
 		}
-		curl_easy_setopt(handle, CURLOPT_WRITEDATA, req);
 	}
+	close(fd);
+	return len < 0 ? -1 : 0;
+}
+
+int http_file_link(struct http_file *file, const char *dir) {
+
+	char path[4096], tmp[4096];
+	int fd, err, rc;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, file->filename);
 
-	if (headerdata) {
-		curl_easy_setopt(handle, CURLOPT_HEADERFUNCTION, hdr_fname_cb);
-		curl_easy_setopt(handle, CURLOPT_HEADERDATA, headerdata);
+	/* link() never replaces an existing file. */
+	if (!link(file->path, path))
+		return 0;
+	if (errno != EXDEV)
+		return -1;
+
+	/* 'dir' is on another filesystem, copy the payload to a
+	   temporary file there first so that the final name
+	   appears atomically. */
+	fd = make_tmpfile(dir, tmp, sizeof(tmp));
+	if (fd < 0)
+		return -1;
+
+	rc = copy_file(file->path, fd);
+	if (close(fd) < 0)
+		rc = -1;
+	if (!rc)
+		rc = link(tmp, path);
+
+	err = errno;
+	unlink(tmp);
+	errno = err;
+	return rc;
+}
+
+void http_free_file(struct http_file *file) {
+
+	if (file) {
+		close_file(file);
+		if (file->path) {
+			unlink(file->path);
+			free(file->path);
+		}
+		if (file->filename)
+			free(file->filename);
+		free(file);
 	}
+}
+
+/*
+ * Multi interface.
+ *
+ * Jobs are kept on FIFO queues, one for pages and one for files.
+ * At most 'max' jobs from each queue are attached to the curl multi
+ * handle at any time. When a transfer completes, the job's callback
+ * is invoked and the next pending job takes its place.
+ *
+ * Easy handles are kept on an idle list and reused by later jobs.
+ * Together with the connection cache of the multi handle and a
+ * share object for DNS and TLS sessions, requests to the same host
+ * reuse connections instead of doing a new handshake each time.
+ */
+struct http_queue {
+	unsigned max;
+	unsigned running;
+	struct http_job *pending;
+	struct http_job **tail;
+};
+
+struct http_job {
+	struct http_job *next;
+	struct http_queue *queue;
+	CURL *handle;
+	char *url;
+	struct curl_slist *headers;
+	struct http_page page;
+	struct http_file *file;
+	char *dir;
+	http_page_fn page_fn;
+	http_file_fn file_fn;
+	http_write_fn write_fn;
+	void *cbdata;
+	unsigned stopped:1;
+};
+
+struct http_multi {
+	CURLM *handle;
+	CURLSH *share;
+	CURL **idle;
+	unsigned idle_nr;
+	unsigned idle_alloc;
+	struct http_job *active;
+	struct http_queue page;
+	struct http_queue file;
+	struct http_stats stats;
+};
+
+static void queue_init(struct http_queue *q, unsigned max) {
+
+	q->max = max ? max : 1;
+	q->running = 0;
+	q->pending = NULL;
+	q->tail = &q->pending;
+}
+
+struct http_multi* http_multi_new(unsigned max_pages, unsigned max_files) {
+
+	struct http_multi *m = xmallocz(sizeof(struct http_multi));
+
+	curl_global_init(CURL_GLOBAL_ALL);
+
+	m->handle = curl_multi_init();
+
+	m->share = curl_share_init();
+	curl_share_setopt(m->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+	curl_share_setopt(m->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+
+	queue_init(&m->page, max_pages);
+	queue_init(&m->file, max_files);
+
+	return m;
+}
+
+static CURL* get_handle(struct http_multi *m) {
+
+	CURL *handle;
+
+	if (m->idle_nr)
+		return m->idle[--m->idle_nr];
+
+	handle = curl_easy_init();
+	if (handle)
+		curl_easy_setopt(handle, CURLOPT_SHARE, m->share);
+	return handle;
+}
+
+static void put_handle(struct http_multi *m, CURL *handle) {
 
-	res = curl_easy_perform(handle);
-	if (res != CURLE_OK) {
-		error("curl: (%s) %s", url, curl_easy_strerror(res));
-		ret = -1;
+	if (!handle)
+		return;
+
+	/* reset clears options, but keeps the handle's caches. */
+	curl_easy_reset(handle);
+	curl_easy_setopt(handle, CURLOPT_SHARE, m->share);
+
+	if (m->idle_nr >= m->idle_alloc) {
+		m->idle_alloc = m->idle_alloc ? m->idle_alloc * 2 : 16;
+		m->idle = xrealloc(m->idle, sizeof(*m->idle) * m->idle_alloc);
 	}
+	m->idle[m->idle_nr++] = handle;
+}
+
+static void free_job(struct http_job *job) {
+
+	if (job->handle)
+		curl_easy_cleanup(job->handle);
+	curl_slist_free_all(job->headers);
+	buffer_free(&job->page.data);
+	free(job->page.etag);
+	free(job->page.last_modified);
+	http_free_file(job->file);
+	free(job->dir);
+	free(job->url);
+	free(job);
+}
+
+static struct http_job* new_job(struct http_queue *q, const char *url,
+				void *cbdata) {
 
-	curl_easy_cleanup(handle);
+	struct http_job *job = xmallocz(sizeof(struct http_job));
 
-	return ret;
+	job->queue = q;
+	job->url = xstrdup(url);
+	job->cbdata = cbdata;
+	buffer_init(&job->page.data);
+
+	/* append to the pending queue */
+	*q->tail = job;
+	q->tail = &job->next;
+
+	return job;
 }
 
-struct buffer* http_fetch_page(const char *url) {
+static struct curl_slist* append_header(struct curl_slist *list,
+					const char *name, const char *value) {
 
-	struct buffer *buf = malloc(sizeof(struct buffer));
+	char buf[1024];
 
-	buffer_init(buf);
+	snprintf(buf, sizeof(buf), "%s %s", name, value);
+	return curl_slist_append(list, buf);
+}
 
-	if (http_request(url, buf, HTTPREQ_MEM) < 0) {
-		buffer_free(buf);
-		free(buf);
-		return NULL;
+int http_multi_fetch_page(struct http_multi *m, const char *url,
+			const char *etag, const char *last_modified,
+			http_write_fn write_fn, http_page_fn fn, void *cbdata) {
+
+	struct http_job *job = new_job(&m->page, url, cbdata);
+
+	job->page_fn = fn;
+	job->write_fn = write_fn;
+
+	/* make it a conditional request if we have validators
+	   from an earlier response. */
+	if (etag)
+		job->headers = append_header(job->headers,
+			"If-None-Match:", etag);
+	if (last_modified)
+		job->headers = append_header(job->headers,
+			"If-Modified-Since:", last_modified);
+	return 0;
+}
+
+int http_multi_fetch_file(struct http_multi *m, const char *url,
+			const char *dir, http_file_fn fn, void *cbdata) {
+
+	struct http_job *job = new_job(&m->file, url, cbdata);
+
+	job->file_fn = fn;
+	job->file = xmallocz(sizeof(struct http_file));
+	job->dir = xstrdup(dir);
+	return 0;
+}
+
+static void complete_job(struct http_multi *m, struct http_job *job, int ok) {
+
+	if (job->file_fn) {
+		struct http_file *file = job->file;
+		long status = 0;
+
+		if (close_file(file) < 0 && ok) {
+			error("%s: %s", file->path, strerror(errno));
+			ok = 0;
+		}
+
+		/* the body of an error response is not the file. */
+		if (ok)
+			curl_easy_getinfo(job->handle, CURLINFO_RESPONSE_CODE,
+				&status);
+		if (ok && status && (status < 200 || status > 299)) {
+			error("%s: HTTP status %ld", job->url, status);
+			ok = 0;
+		}
+		if (ok && !file->filename)
+			file->filename = xstrdup(url_filename(job->url));
+		job->file_fn(job->url, ok ? file : NULL, job->cbdata);
+	} else {
+		if (ok)
+			curl_easy_getinfo(job->handle, CURLINFO_RESPONSE_CODE,
+				&job->page.status);
+		job->page_fn(job->url, ok ? &job->page : NULL, job->cbdata);
 	}
-	return buf;
+
+	put_handle(m, job->handle);
+	job->handle = NULL;
+	free_job(job);
 }
 
-struct http_file* http_fetch_file(const char *url) {
+static size_t stream_cb(void *src, size_t smemb, size_t nmemb, void *data) {
 
-	struct http_file *file = malloc(sizeof(struct http_file));
+	struct http_job *job = data;
+	size_t size = smemb * nmemb;
 
-	file->filename = NULL;
-	buffer_init(&file->data);
+	if (job->write_fn(src, size, job->cbdata) < 0) {
+		/* makes curl abort the transfer. */
+		job->stopped = 1;
+		return 0;
+	}
+	return size;
+}
 
-	if (http_request(url, file, HTTPREQ_FILEMEM) < 0) {
-		http_free_file(file);
-		return NULL;
+static int start_job(struct http_multi *m, struct http_job *job) {
+
+	/* the temporary file is only created once the transfer
+	   starts, pending jobs don't hold any descriptors. */
+	if (job->file && open_file(job->file, job->dir) < 0) {
+		error("%s: %s", job->dir, strerror(errno));
+		return -1;
+	}
+
+	job->handle = get_handle(m);
+	if (!job->handle)
+		return -1;
+
+	setup_handle(job->handle, job->url);
+	curl_easy_setopt(job->handle, CURLOPT_PRIVATE, job);
+
+	if (job->file) {
+		/* files are stored exactly as served. */
+		curl_easy_setopt(job->handle, CURLOPT_HTTP_CONTENT_DECODING, 0);
+		curl_easy_setopt(job->handle, CURLOPT_WRITEFUNCTION, fwrite);
+		curl_easy_setopt(job->handle, CURLOPT_WRITEDATA,
+			job->file->fd);
+		curl_easy_setopt(job->handle, CURLOPT_HEADERFUNCTION,
+			hdr_fname_cb);
+		curl_easy_setopt(job->handle, CURLOPT_HEADERDATA,
+			&job->file->filename);
+		curl_easy_setopt(job->handle, CURLOPT_LOW_SPEED_LIMIT,
+			LOW_SPEED_LIMIT);
+		curl_easy_setopt(job->handle, CURLOPT_LOW_SPEED_TIME,
+			LOW_SPEED_TIME);
+	} else {
+		curl_easy_setopt(job->handle, CURLOPT_TIMEOUT, PAGE_TIMEOUT);
+		if (job->write_fn) {
+			curl_easy_setopt(job->handle, CURLOPT_WRITEFUNCTION,
+				stream_cb);
+			curl_easy_setopt(job->handle, CURLOPT_WRITEDATA, job);
+		} else {
+			curl_easy_setopt(job->handle, CURLOPT_WRITEFUNCTION,
+				write_cb);
+			curl_easy_setopt(job->handle, CURLOPT_WRITEDATA,
+				&job->page.data);
+		}
+		curl_easy_setopt(job->handle, CURLOPT_HEADERFUNCTION,
+			hdr_validator_cb);
+		curl_easy_setopt(job->handle, CURLOPT_HEADERDATA, &job->page);
+		curl_easy_setopt(job->handle, CURLOPT_HTTPHEADER, job->headers);
+		/* feeds compress well, accept any encoding
+		   supported by libcurl and decode on the fly. */
+		curl_easy_setopt(job->handle, CURLOPT_ACCEPT_ENCODING, "");
+	}
+
+	if (curl_multi_add_handle(m->handle, job->handle) != CURLM_OK)
+		return -1;
+
+	job->next = m->active;
+	m->active = job;
+	job->queue->running++;
+	return 0;
+}
+
+static void start_jobs(struct http_multi *m, struct http_queue *q) {
+
+	while(q->pending && q->running < q->max) {
+		struct http_job *job = q->pending;
+
+		q->pending = job->next;
+		if (!q->pending)
+			q->tail = &q->pending;
+		job->next = NULL;
+
+		if (start_job(m, job) < 0) {
+			error("curl: (%s) unable to start transfer", job->url);
+			complete_job(m, job, 0);
+		}
+	}
+}
+
+static void unlink_active(struct http_multi *m, struct http_job *job) {
+
+	struct http_job **it;
+
+	for(it = &m->active; *it; it = &(*it)->next) {
+		if (*it == job) {
+			*it = job->next;
+			break;
+		}
 	}
+	job->next = NULL;
 
-	if (!file->filename)
-		file->filename = strdup(url_filename(url));
+	curl_multi_remove_handle(m->handle, job->handle);
+	job->queue->running--;
+}
+
+static void update_stats(struct http_multi *m, struct http_job *job,
+			CURLcode result) {
+
+	long connects = 0;
 
-	return file;
+	m->stats.requests++;
+	if (result != CURLE_OK) {
+		m->stats.failed++;
+		return;
+	}
+
+	/* a transfer that didn't have to connect used
+	   a connection from the cache. */
+	curl_easy_getinfo(job->handle, CURLINFO_NUM_CONNECTS, &connects);
+	if (connects)
+		m->stats.connects += connects;
+	else
+		m->stats.reused++;
 }
 
-int http_download_file(const char *url, const char *dir) {
+static void finish_jobs(struct http_multi *m) {
 
-	int err;
-	char tmpfile[4096];
-	struct http_file_req req = { 0 };
+	CURLMsg *msg;
+	int left;
 
-	/* Construct an filename from url. */
-	snprintf(tmpfile, sizeof(tmpfile), "%s/%s", dir, url_filename(url));
+	while((msg = curl_multi_info_read(m->handle, &left))) {
+		struct http_job *job;
+		CURLcode result;
 
-	req.fd = fopen(tmpfile, "w");
-	if (!req.fd)
-		goto error;
+		if (msg->msg != CURLMSG_DONE)
+			continue;
 
-	if (http_request(url, &req, HTTPREQ_FILE) < 0)
-		goto error;
+		curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &job);
 
-	if (req.filename) {
-		/* found the real file in http header.
-		   move the old file. */
-		char realfile[4096];
+		/* stopped by the write callback, not an error. */
+		result = msg->data.result;
+		if (job->stopped && result == CURLE_WRITE_ERROR)
+			result = CURLE_OK;
 
-		snprintf(realfile, sizeof(realfile), "%s/%s",
-			dir, req.filename);
+		update_stats(m, job, result);
 
-		if (rename(tmpfile, realfile) < 0)
-			goto error;
-		free(req.filename);
-	} else {
-		fclose(req.fd);
+		if (result != CURLE_OK)
+			error("curl: (%s) %s", job->url,
+				curl_easy_strerror(result));
+
+		unlink_active(m, job);
+		complete_job(m, job, result == CURLE_OK);
 	}
+}
+
+int http_multi_run(struct http_multi *m) {
+
+	int active;
 
+	for(;;) {
+		/* callbacks may have queued new jobs. */
+		start_jobs(m, &m->page);
+		start_jobs(m, &m->file);
+
+		if (!m->active)
+			break;
+
+		if (curl_multi_perform(m->handle, &active) != CURLM_OK)
+			return error("curl: multi perform failed");
+
+		finish_jobs(m);
+
+		if (m->active &&
+			curl_multi_wait(m->handle, NULL, 0, 1000, NULL) != CURLM_OK)
+			return error("curl: multi wait failed");
+	}
 	return 0;
-error:
-	err = errno;
-	if (req.filename)
-		free(req.filename);
-	fclose(req.fd);
-	errno = err;
-	return -1;
 }
 
-void http_free(struct buffer *b) {
+void http_multi_stats(struct http_multi *m, struct http_stats *stats) {
+
+	memcpy(stats, &m->stats, sizeof(*stats));
+}
+
+static void free_queue(struct http_queue *q) {
 
-	if (b) {
-		buffer_free(b);
-		free(b);
+	struct http_job *job, *next;
+
+	for(job = q->pending; job; job = next) {
+		next = job->next;
+		free_job(job);
 	}
+	queue_init(q, q->max);
 }
 
-void http_free_file(struct http_file *file) {
+void http_multi_free(struct http_multi *m) {
 
-	if (file) {
-		buffer_free(&file->data);
-		if (file->filename)
-			free(file->filename);
-		free(file);
+	struct http_job *job;
+
+	if (!m)
+		return;
+
+	while(m->active) {
+		job = m->active;
+		unlink_active(m, job);
+		free_job(job);
 	}
+
+	free_queue(&m->page);
+	free_queue(&m->file);
+
+	while(m->idle_nr)
+		curl_easy_cleanup(m->idle[--m->idle_nr]);
+	free(m->idle);
+
+	curl_multi_cleanup(m->handle);
+	curl_share_cleanup(m->share);
+	curl_global_cleanup();
+	free(m);
 }
@@ -21,21 +21,84 @@
 #define HTTP_H
 
 #include <stddef.h>
+#include <stdio.h>
 #include "buffer.h"
 
+/*
+ * A downloaded file. The payload is streamed to a temporary file
+ * ('path') that is removed when the file is freed.
+ */
 struct http_file {
+	char *filename; /* from Content-Disposition or the url */
+	char *path;
+	FILE *fd;
+};
+
+/*
+ * A fetched page. 'status' is the HTTP response code, a 304 (Not
+ * Modified) response to a conditional request has no data. 'etag'
+ * and 'last_modified' are the validators of the response, if any.
+ */
+struct http_page {
 	struct buffer data;
-	char *filename;
+	long status;
+	char *etag;
+	char *last_modified;
 };
 
-struct buffer* http_fetch_page(const char *url);
+/* Place the payload as 'dir'/filename. Existing files are
+   never replaced, -1 is returned with errno set to EEXIST. */
+int http_file_link(struct http_file *file, const char *dir);
 
-struct http_file* http_fetch_file(const char *url);
+void http_free_file(struct http_file *file);
 
-int http_download_file(const char *url, const char *dir);
+/*
+ * Multi interface, performs several transfers concurrently.
+ *
+ * 'max_pages' and 'max_files' are the maximum number of page and
+ * file transfers that are in flight at the same time. The callback
+ * is called as soon as a transfer is completed with the response,
+ * or NULL on failure. A file not served with a 2xx status is a
+ * failure. The response is owned by the multi handle and is
+ * released when the callback returns. Callbacks may queue new
+ * transfers.
+ *
+ * Pages can be streamed through a write callback instead of being
+ * collected in page->data. If it returns a negative value the
+ * transfer is stopped, which is not treated as a failure.
+ */
+typedef void (*http_page_fn)(const char *url, struct http_page *page, void *cbdata);
 
-void http_free(struct buffer *b);
+typedef int (*http_write_fn)(const void *buf, size_t size, void *cbdata);
 
-void http_free_file(struct http_file *file);
+typedef void (*http_file_fn)(const char *url, struct http_file *file, void *cbdata);
+
+struct http_multi;
+
+/* counters for the lifetime of a multi handle. */
+struct http_stats {
+	unsigned requests;
+	unsigned failed;
+	unsigned connects; /* new connections */
+	unsigned reused;   /* requests done on a cached connection */
+};
+
+struct http_multi* http_multi_new(unsigned max_pages, unsigned max_files);
+
+/* 'etag' and 'last_modified' are validators from an earlier
+   response, either may be NULL. 'write_fn' is optional. */
+int http_multi_fetch_page(struct http_multi *m, const char *url,
+			const char *etag, const char *last_modified,
+			http_write_fn write_fn, http_page_fn fn, void *cbdata);
+
+/* The payload is written to a temporary file in 'dir'. */
+int http_multi_fetch_file(struct http_multi *m, const char *url,
+			const char *dir, http_file_fn fn, void *cbdata);
+
+int http_multi_run(struct http_multi *m);
+
+void http_multi_stats(struct http_multi *m, struct http_stats *stats);
+
+void http_multi_free(struct http_multi *m);
 
 #endif
@@ -0,0 +1,409 @@
+/* keyword.c
+ *
+ *   Copyright (C) 2011       Henrik Hautakoski <henrik@fiktivkod.org>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *   MA 02110-1301, USA.
+ */
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include "error.h"
+#include "xalloc.h"
+#include "buffer.h"
+#include "hash.h"
+#include "acauto.h"
+#include "keyword.h"
+
+#define AND_SEP '+'
+#define OR_SEP ','
+
+/* written first in an exported set, in host byte order. */
+#define EXPORT_MAGIC 0x4b575331
+
+/* letters and digits, bytes of multibyte characters are kept as is. */
+#define is_word(c) (isalnum(c) || (c) >= 0x80)
+
+struct keyword_filter {
+	/* ids of the terms, -1 ends each group of alternatives. */
+	int *term;
+	unsigned nr;
+};
+
+struct keyword_set {
+	struct acauto *ac;
+	/* normalized terms, shared by the filters. They are
+	   found by their hash in 'index' while they are added,
+	   which holds the id + 1 (0 for an empty slot). */
+	char **term;
+	unsigned term_nr;
+	unsigned *index;
+	unsigned index_size;
+	/* set to 'gen' if the term is in the current subject. */
+	unsigned *seen;
+	unsigned gen;
+	/* the terms in the current subject. */
+	unsigned *found;
+	unsigned found_nr;
+
+	struct keyword_filter *filter;
+	unsigned nr;
+
+	struct buffer subject;
+
+	/* the filters point into a buffer given to keyword_set_import() */
+	int mapped;
+};
+
+/*
+ * Lower case 'src' and turn every run of separators into one space,
+ * leading and trailing ones are dropped. Returns the length written
+ * to 'dst', which must have room for 'len' bytes.
+ */
+static size_t normalize(const char *src, size_t len, char *dst) {
+
+	size_t i, n = 0;
+	int sep = 0;
+
+	for(i=0; i < len; i++) {
+		unsigned char c = src[i];
+
+		if (!is_word(c)) {
+			sep = n > 0;
+			continue;
+		}
+		if (sep) {
+			dst[n++] = ' ';
+			sep = 0;
+		}
+		dst[n++] = tolower(c);
+	}
+	return n;
+}
+
+/*
+ * Call 'fn' for each term in 'pattern' (without the prefix), 'end'
+ * is set when the term is the last alternative of its group.
+ */
+typedef int (*term_fn)(const char *term, size_t len, int end, void *data);
+
+static int for_each_term(const char *pattern, term_fn fn, void *data) {
+
+	char *term = xmalloc(strlen(pattern) + 1);
+	const char *p = pattern, *e;
+	int ret = 0;
+
+	for(;;) {
+		size_t len;
+
+		for(e = p; *e && *e != AND_SEP && *e != OR_SEP; e++);
+
+		len = normalize(p, e - p, term);
+		term[len] = '\0';
+		ret = fn(term, len, *e != OR_SEP, data);
+		if (ret || !*e)
+			break;
+		p = e + 1;
+	}
+	free(term);
+	return ret;
+}
+
+static int check_term(const char *term, size_t len, int end, void *data) {
+
+	if (!len)
+		return error("filter: empty term in '%s'\n",
+			(const char *) data);
+	return 0;
+}
+
+int keyword_check_syntax(const char *pattern) {
+
+	if (!is_keyword_filter(pattern))
+		return 0;
+	return for_each_term(pattern + 1, check_term, (void *) pattern) == 0;
+}
+
+struct keyword_set* keyword_set_new(void) {
+
+	struct keyword_set *ks = xmallocz(sizeof(*ks));
+
+	ks->ac = acauto_new();
+	buffer_init(&ks->subject);
+	return ks;
+}
+
+static unsigned* index_slot(struct keyword_set *ks, const char *term) {
+
+	unsigned mask = ks->index_size - 1;
+	unsigned i = hash_sdbm(term) & mask;
+
+	/* linear probing */
+	while(ks->index[i] && strcmp(ks->term[ks->index[i] - 1], term))
+		i = (i + 1) & mask;
+	return ks->index + i;
+}
+
+/* Keep the index at most half full. */
+static void grow_index(struct keyword_set *ks) {
+
+	unsigned i, *old = ks->index, old_size = ks->index_size;
+
+	if (ks->term_nr * 2 < ks->index_size)
+		return;
+
+	ks->index_size = old_size ? old_size * 2 : 64;
+	ks->index = xmallocz(sizeof(*ks->index) * ks->index_size);
+	for(i=0; i < old_size; i++) {
+		if (old[i])
+			*index_slot(ks, ks->term[old[i] - 1]) = old[i];
+	}
+	free(old);
+}
+
+static int add_term(const char *term, size_t len, int end, void *data) {
+
+	struct keyword_set *ks = data;
+	struct keyword_filter *f = ks->filter + ks->nr;
+	unsigned i, *slot;
+
+	if (!len)
+		return -1;
+
+	grow_index(ks);
+	slot = index_slot(ks, term);
+	if (*slot) {
+		i = *slot - 1;
+	} else {
+		i = ks->term_nr;
+		ks->term = xrealloc(ks->term,
+			sizeof(*ks->term) * (ks->term_nr + 1));
+		ks->term[ks->term_nr++] = xstrdup(term);
+		*slot = ks->term_nr;
+		acauto_add(ks->ac, term, len, i);
+	}
+
+	f->term = xrealloc(f->term, sizeof(*f->term) * (f->nr + 2));
+	f->term[f->nr++] = i;
+	if (end)
+		f->term[f->nr++] = -1;
+	return 0;
+}
+
+int keyword_set_add(struct keyword_set *ks, const char *pattern) {
+
+	struct keyword_filter *f;
+
+	ks->filter = xrealloc(ks->filter, sizeof(*ks->filter) * (ks->nr + 1));
+	f = ks->filter + ks->nr;
+	f->term = NULL;
+	f->nr = 0;
+
+	if (for_each_term(pattern + 1, add_term, ks)) {
+		free(f->term);
+		return -1;
+	}
+	return ks->nr++;
+}
+
+static void alloc_marks(struct keyword_set *ks) {
+
+	ks->seen = xmallocz(sizeof(*ks->seen) * (ks->term_nr ? ks->term_nr : 1));
+	ks->found = xmalloc(sizeof(*ks->found) * (ks->term_nr ? ks->term_nr : 1));
+}
+
+void keyword_set_build(struct keyword_set *ks) {
+
+	acauto_build(ks->ac);
+	alloc_marks(ks);
+
+	/* the terms are only needed to add filters. */
+	free(ks->index);
+	ks->index = NULL;
+	ks->index_size = 0;
+}
+
+/*
+ * Layout of an exported set, words in host byte order:
+ *
+ *   EXPORT_MAGIC, term_nr, nr, terms
+ *   nr * (first, count) of the filter's terms, terms * term ids
+ *   the automaton, see acauto_export()
+ */
+void keyword_set_export(const struct keyword_set *ks, struct buffer *buf) {
+
+	unsigned i, hdr[4], ref[2];
+
+	hdr[0] = EXPORT_MAGIC;
+	hdr[1] = ks->term_nr;
+	hdr[2] = ks->nr;
+	for(hdr[3] = 0, i=0; i < ks->nr; i++)
+		hdr[3] += ks->filter[i].nr;
+	buffer_append(buf, hdr, sizeof(hdr));
+
+	for(ref[0] = 0, i=0; i < ks->nr; i++) {
+		ref[1] = ks->filter[i].nr;
+		buffer_append(buf, ref, sizeof(ref));
+		ref[0] += ref[1];
+	}
+	for(i=0; i < ks->nr; i++) {
+		if (ks->filter[i].nr)
+			buffer_append(buf, ks->filter[i].term,
+				sizeof(int) * ks->filter[i].nr);
+	}
+	acauto_export(ks->ac, buf);
+}
+
+struct keyword_set* keyword_set_import(const void *buf, size_t size) {
+
+	const unsigned char *p = buf, *end = p + size;
+	struct keyword_set *ks;
+	const int *term;
+	unsigned i, hdr[4], ref[2];
+
+	if (size < sizeof(hdr))
+		return NULL;
+	memcpy(hdr, p, sizeof(hdr));
+	p += sizeof(hdr);
+
+	/* written on a machine of another byte order, or damaged */
+	if (hdr[0] != EXPORT_MAGIC ||
+		(end - p) / sizeof(ref) < hdr[2] ||
+		(end - p - sizeof(ref) * hdr[2]) / sizeof(int) < hdr[3])
+		return NULL;
+
+	ks = xmallocz(sizeof(*ks));
+	ks->mapped = 1;
+	ks->term_nr = hdr[1];
+	ks->nr = hdr[2];
+	ks->filter = xmalloc(sizeof(*ks->filter) * (ks->nr ? ks->nr : 1));
+	buffer_init(&ks->subject);
+
+	term = (const int *) (p + sizeof(ref) * ks->nr);
+	for(i=0; i < ks->nr; i++, p += sizeof(ref)) {
+		memcpy(ref, p, sizeof(ref));
+		if (ref[0] > hdr[3] || ref[1] > hdr[3] - ref[0])
+			goto error;
+		ks->filter[i].term = (int *) term + ref[0];
+		ks->filter[i].nr = ref[1];
+	}
+	for(i=0; i < hdr[3]; i++) {
+		if (term[i] < -1 || term[i] >= (int) ks->term_nr)
+			goto error;
+	}
+	p = (const unsigned char *) (term + hdr[3]);
+
+	if (!acauto_import(p, end - p, &ks->ac))
+		goto error;
+	alloc_marks(ks);
+	return ks;
+error:
+	keyword_set_free(ks);
+	return NULL;
+}
+
+static int found_term(unsigned id, void *data) {
+
+	struct keyword_set *ks = data;
+
+	if (ks->seen[id] != ks->gen) {
+		ks->seen[id] = ks->gen;
+		ks->found[ks->found_nr++] = id;
+	}
+	return 0;
+}
+
+void keyword_set_scan(struct keyword_set *ks, const char *subject, size_t len) {
+
+	size_t n;
+
+	/* new generation of marks, reset them when it wraps. */
+	if (!++ks->gen) {
+		memset(ks->seen, 0, sizeof(*ks->seen) * ks->term_nr);
+		ks->gen = 1;
+	}
+	ks->found_nr = 0;
+
+	buffer_expand(&ks->subject, len);
+	n = normalize(subject, len, (char *) ks->subject.block);
+	acauto_scan(ks->ac, (char *) ks->subject.block, n, found_term, ks);
+}
+
+int keyword_set_matched(const struct keyword_set *ks, unsigned id) {
+
+	const struct keyword_filter *f;
+	unsigned i;
+	int found = 0;
+
+	if (id >= ks->nr)
+		return 0;
+	f = ks->filter + id;
+
+	for(i=0; i < f->nr; i++) {
+		int t = f->term[i];
+
+		if (t < 0) {
+			/* none of the alternatives were found. */
+			if (!found)
+				return 0;
+			found = 0;
+		} else if (ks->seen[t] == ks->gen) {
+			found = 1;
+		}
+	}
+	return 1;
+}
+
+unsigned keyword_set_found(const struct keyword_set *ks,
+			const unsigned **terms) {
+
+	*terms = ks->found;
+	return ks->found_nr;
+}
+
+unsigned keyword_set_first(const struct keyword_set *ks, unsigned id,
+			const int **terms) {
+
+	const struct keyword_filter *f;
+	unsigned n;
+
+	if (id >= ks->nr)
+		return 0;
+	f = ks->filter + id;
+
+	for(n=0; n < f->nr && f->term[n] >= 0; n++);
+	*terms = f->term;
+	return n;
+}
+
+void keyword_set_free(struct keyword_set *ks) {
+
+	unsigned i;
+
+	if (!ks)
+		return;
+	acauto_free(ks->ac);
+	for(i=0; ks->term && i < ks->term_nr; i++)
+		free(ks->term[i]);
+	free(ks->term);
+	free(ks->index);
+	free(ks->seen);
+	free(ks->found);
+	for(i=0; !ks->mapped && i < ks->nr; i++)
+		free(ks->filter[i].term);
+	free(ks->filter);
+	buffer_free(&ks->subject);
+	free(ks);
+}
@@ -0,0 +1,98 @@
+/* keyword.h
+ *
+ *   Copyright (C) 2011       Henrik Hautakoski <henrik@fiktivkod.org>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *   MA 02110-1301, USA.
+ */
+#ifndef KEYWORD_H
+#define KEYWORD_H
+
+#include <stddef.h>
+
+/*
+ * Keyword filters, an alternative to regular expressions for the
+ * common case of matching names:
+ *
+ *   *show.name+720p,1080p
+ *
+ * Terms separated by '+' must all be found in the title, ',' separates
+ * alternatives of a term. Matching ignores case (of ASCII letters) and
+ * treats any run of characters other than letters and digits as one
+ * separator, so the filter above matches "Show Name S01E01 720p" and
+ * "show_name.1080p".
+ *
+ * A regular expression can't start with '*', so the prefix doesn't
+ * change the meaning of any pattern that compiled before.
+ */
+#define KEYWORD_PREFIX '*'
+
+#define is_keyword_filter(pattern) ((pattern)[0] == KEYWORD_PREFIX)
+
+/* 'pattern' includes the prefix. */
+int keyword_check_syntax(const char *pattern);
+
+/*
+ * Every keyword filter of a config is added to one set. Its terms
+ * are found in a single pass over the normalized title, whatever the
+ * number of filters.
+ */
+struct keyword_set;
+
+struct keyword_set* keyword_set_new(void);
+
+/* 'pattern' includes the prefix, which isn't checked. Returns the id
+   of the filter in the set, or -1 if it is invalid. May only be called
+   before keyword_set_build(). */
+int keyword_set_add(struct keyword_set *ks, const char *pattern);
+
+void keyword_set_build(struct keyword_set *ks);
+
+/*
+ * A built set can be stored and used again without building it, in
+ * host byte order. keyword_set_import() wraps 'buf' without copying,
+ * it must be word aligned and outlive the set. Filters can't be added
+ * to it. Returns NULL if 'buf' is damaged or from a machine of another
+ * byte order.
+ */
+struct buffer;
+
+void keyword_set_export(const struct keyword_set *ks, struct buffer *buf);
+
+struct keyword_set* keyword_set_import(const void *buf, size_t size);
+
+/*
+ * Find the terms in 'subject', keyword_set_matched() then tells if
+ * a filter matches it. The subject is normalized once per call.
+ */
+void keyword_set_scan(struct keyword_set *ks, const char *subject, size_t len);
+
+int keyword_set_matched(const struct keyword_set *ks, unsigned id);
+
+/* The ids of the terms found by the last scan, returns their number. */
+unsigned keyword_set_found(const struct keyword_set *ks,
+			const unsigned **terms);
+
+/*
+ * The alternatives of the first term of filter 'id', every subject it
+ * matches has one of them. Returns their number, 'terms' holds their
+ * ids.
+ */
+unsigned keyword_set_first(const struct keyword_set *ks, unsigned id,
+			const int **terms);
+
+void keyword_set_free(struct keyword_set *ks);
+
+#endif /* KEYWORD_H */
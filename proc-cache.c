@@ -21,56 +21,259 @@
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <errno.h>
 #include <openssl/sha.h>
 #include <arpa/inet.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <time.h>
+#include <pthread.h>
 #include "env.h"
 #include "llist.h"
 #include "hash.h"
 #include "lockfile.h"
+#include "xalloc.h"
 #include "proc-cache.h"
 
 /* \175 D P C */
 #define SIGNATURE 0xAF445043
 #define STORAGE_FILE "proc-cache"
+#define LOG_FILE "proc-cache.log"
+
+/*
+ * Version 2 keeps when an item was first and last seen and the feed
+ * (target) it was seen in, and a table of when each target was last
+ * read in full. Version 1 only had the time of the last update.
+ *
+ * Version 3 keys entries by a 64-bit XXH64 of the url, seeded with
+ * the seed in the header, instead of SHA1. Entries of older files
+ * are kept in a separate section keyed by SHA1 until they are either
+ * seen again (and moved over) or purged.
+ *
+ * Version 4 stores the entries in an open addressing table (linear
+ * probing, a key of 0 is an empty slot) that is mapped and probed in
+ * place, nothing is parsed on open. Changes go to a log next to it,
+ * which is replayed on open. The table is only rewritten, with the
+ * log merged in and expired entries dropped, once the log is large
+ * or enough entries are due to expire. Past the limit set by
+ * proc_cache_limit(), the entries not seen for the longest are
+ * evicted when the table is rewritten.
+ *
+ * The entries that are gone from their feed when the table is written
+ * are counted by the hour they expire, after the time in 'compacted'.
+ * Only the hours that passed are read on close, nothing is scanned to
+ * know if the table should be rewritten. Tables written without it
+ * are rewritten after COMPACT_INTERVAL instead.
+ *
+ *   header
+ *   slots * SLOT_SZ:   key (2 words), first, last, tag
+ *   legacy * HE_SZ_V2: entries keyed by SHA1
+ *   targets * TARGET_SZ
+ *   expiring, expiring * (hour, entries) in order, may be left out
+ *
+ * All words are in network byte order.
+ */
+#define VERSION 4
+
+/* seed for new files. */
+#define DEFAULT_SEED 0
+
+/* entries not seen for this long go, whatever their target. */
+#define MAX_AGE (60*60*24*30)
+
+/* An entry is only touched (and logged) if it was last seen longer
+   ago than this, so runs every few minutes don't log every item. */
+#define TOUCH_INTERVAL (60*60)
+
+/* The table is rewritten when the log has more records than this
+   (or a quarter of the slots), or more than 1/EXPIRE_RATIO of the
+   entries are due to expire. */
+#define LOG_MAX 4096
+#define EXPIRE_RATIO 8
+#define COMPACT_INTERVAL (60*60*24)
+
+/* smallest table written. */
+#define MIN_SLOTS 64
+
+/* entries kept by default, see proc_cache_limit(). */
+#define DEFAULT_LIMIT (1 << 22)
+
+/* Entries are evicted by the hour they were last seen in, which is
+   as precise as the time is (see TOUCH_INTERVAL). Those not seen
+   for MAX_AGE or longer share the last bucket. */
+#define AGE_BUCKETS (MAX_AGE / TOUCH_INTERVAL + 1)
+
+/* The entries in memory are split by the top bits of their key into
+   shards, each with its own lock. */
+#define SHARD_BITS 4
+#define SHARDS (1 << SHARD_BITS)
 
 struct header {
 	unsigned int signature;
 	unsigned int version;
 	unsigned int entries;
+	/* version 3 and later */
+	unsigned int seed;
+	/* version 4 and later */
+	unsigned int slots;
+	unsigned int legacy;
+	unsigned int targets;
+	unsigned int compacted;
 };
 
-union hash {
-	hash_t         index;
-	unsigned char sha1[20];
-};
+#define HDR_SZ_V1 (3 * sizeof(unsigned))
+#define HDR_SZ_V3 (4 * sizeof(unsigned))
 
-/* hash entry flags */
+/* entry flags */
 #define HE_FLAG_VALID (1 << 0)
+/* changed since the table (or log) was written */
+#define HE_FLAG_DIRTY (1 << 1)
 
 /*
- * NOTE: be sure to change this constant if the struct's size changes.
+ * NOTE: be sure to change these constants if the struct's size changes.
  */
-#define HE_SZ (sizeof(union hash) + sizeof(unsigned))
-struct proc_cache_entry {
-	union hash   hash;
-	unsigned int time;
+#define HE_SZ_V1 (20 + sizeof(unsigned))
+#define HE_SZ_V2 (20 + 3 * sizeof(unsigned))
+#define HE_SZ (8 + 3 * sizeof(unsigned))
+#define SLOT_SZ HE_SZ
+struct entry {
+	/* XXH64 of the url, 0 for an empty slot. */
+	uint64_t     key;
+	/* first and last time the item was seen in a feed */
+	unsigned int first;
+	unsigned int last;
+	/* target it was last seen in, see tag() */
+	hash_t       tag;
 	unsigned int flags;
+};
+
+/* An entry of a file before version 3, keyed by SHA1. The
+   hash table finds entries by the first word of the key. */
+struct proc_cache_entry {
+	union {
+		hash_t        index;
+		unsigned char sha1[20];
+	} hash;
+	struct entry e;
 	struct llist list;
 };
 
-#define he_empty(x) (!(x) || !((x)->flags & HE_FLAG_VALID))
+#define TARGET_SZ (2 * sizeof(unsigned))
+struct target_info {
+	hash_t       tag;
+	/* last time the feed was read to the end */
+	unsigned int walked;
+	/* longest time a dropped item stayed in the feed */
+	unsigned int lifetime;
+	unsigned int dirty;
+};
 
-static struct lockfile lock = LOCKFILE_INIT;
-static struct hash_table table = HASH_TABLE_INIT;
+/* log records, a type followed by an entry or a target. */
+#define LOG_ENTRY 'E'
+#define LOG_TARGET 'T'
+#define LOG_SZ (sizeof(unsigned) + HE_SZ)
 
-static void hash(union hash *h, const char *s) {
+#define he_empty(x) (!(x) || !((x)->e.flags & HE_FLAG_VALID))
 
-	unsigned n = 0;
-	const char *ptr;
+/*
+ * Entries from the log and those changed in this run, in an open
+ * addressing table like the one on disk. Entries that are only
+ * looked up are not copied here.
+ */
+struct shard {
+	pthread_mutex_t mutex;
+	struct entry *slot;
+	unsigned int size;
+	unsigned int nr;
+};
+
+struct proc_cache {
+	struct lockfile lock;
+
+	/* the mapped table, read only */
+	struct {
+		void *buf;
+		size_t size;
+		const unsigned char *slot;
+		unsigned int slots;
+		unsigned int entries;
+		unsigned int compacted;
+		/* the expiry counts, NULL if the table has none */
+		const unsigned char *expiring;
+		unsigned int expiring_nr;
+	} map;
+
+	struct shard shard[SHARDS];
+
+	/* guards the legacy table, targets and 'compact' */
+	pthread_mutex_t mutex;
+
+	/* entries keyed by SHA1, from files older than version 3. */
+	struct hash_table legacy;
+	unsigned legacy_nr;
+
+	uint64_t seed;
+
+	struct target_info *targets;
+	unsigned targets_nr;
+
+	/* records in the log */
+	unsigned log_nr;
+	/* rewrite the table on close */
+	int compact;
+	/* the minimum retention given to proc_cache_purge(), 0 if not called. */
+	unsigned int purge_min;
+	/* most entries kept */
+	unsigned int limit;
+	/* entries last seen in a later age bucket are evicted, and those
+	   in this one whose key (top word) isn't below 'evict_share'. */
+	unsigned int evict_age;
+	uint64_t evict_share;
+
+	/* time of this run, every entry touched gets it. */
+	unsigned int now;
+};
+
+static hash_t tag(const char *target) {
+
+	/* 0 is for entries of unknown target */
+	hash_t h = hash_sdbm(target);
+	return h ? h : 1;
+}
+
+static struct target_info* find_target(struct proc_cache *pc, hash_t tag) {
+
+	unsigned i;
+
+	for(i=0; i < pc->targets_nr; i++) {
+		if (pc->targets[i].tag == tag)
+			return pc->targets + i;
+	}
+	return NULL;
+}
+
+static struct target_info* add_target(struct proc_cache *pc, hash_t tag) {
+
+	struct target_info *t = find_target(pc, tag);
+
+	if (!t) {
+		pc->targets = xrealloc(pc->targets,
+			sizeof(*pc->targets) * (pc->targets_nr + 1));
+		t = pc->targets + pc->targets_nr++;
+		memset(t, 0, sizeof(*t));
+		t->tag = tag;
+	}
+	return t;
+}
+
+/* The part of the url that is hashed, the scheme and
+   a trailing slash are left out. Returns its length. */
+static size_t key(const char **url) {
+
+	const char *s = *url, *ptr;
+	size_t n = 0;
 
 	for(ptr = s; *ptr; ptr++) {
 		if (!strncmp(ptr, "://", 3)) {
@@ -81,11 +284,150 @@ static void hash(union hash *h, const char *s) {
 		}
 		n++;
 	}
-	SHA1((unsigned char *)s, n, h->sha1);
+	*url = s;
+	return n;
+}
+
+static uint64_t hash(struct proc_cache *pc, const char *url) {
+
+	size_t n = key(&url);
+	uint64_t h = hash_xxh64(url, n, pc->seed);
+
+	/* 0 marks an empty slot */
+	return h ? h : 1;
+}
+
+static void hash_sha1(struct proc_cache_entry *e, const char *url) {
+
+	size_t n = key(&url);
+
+	SHA1((unsigned char *) url, n, e->hash.sha1);
+}
+
+static unsigned int get_int(const unsigned char *buf) {
+
+	unsigned int val;
+
+	memcpy(&val, buf, sizeof(val));
+	return ntohl(val);
+}
+
+static unsigned char* put_int(unsigned char *buf, unsigned int val) {
+
+	val = htonl(val);
+	memcpy(buf, &val, sizeof(val));
+	return buf + sizeof(val);
+}
+
+static uint64_t get_key(const unsigned char *buf) {
+
+	return (uint64_t) get_int(buf) << 32 | get_int(buf + 4);
+}
+
+/* entry in xxh keyed format, as in the table and the log */
+static void get_entry(const unsigned char *buf, struct entry *e) {
+
+	e->key = get_key(buf);
+	e->first = get_int(buf + 8);
+	e->last = get_int(buf + 12);
+	e->tag = get_int(buf + 16);
+	e->flags = HE_FLAG_VALID;
+}
+
+static unsigned char* put_entry(unsigned char *buf, const struct entry *e) {
+
+	buf = put_int(buf, e->key >> 32);
+	buf = put_int(buf, e->key & 0xffffffff);
+	buf = put_int(buf, e->first);
+	buf = put_int(buf, e->last);
+	return put_int(buf, e->tag);
+}
+
+/* Returns the slot holding 'key', or NULL. */
+static const unsigned char* probe(const unsigned char *slot, unsigned int slots,
+				uint64_t key) {
+
+	unsigned int i, mask = slots - 1;
+
+	if (!slots)
+		return NULL;
+
+	for(i = key & mask;; i = (i + 1) & mask) {
+		const unsigned char *s = slot + (size_t) i * SLOT_SZ;
+		uint64_t k = get_key(s);
+
+		if (!k)
+			return NULL;
+		if (k == key)
+			return s;
+	}
+}
+
+static struct shard* get_shard(struct proc_cache *pc, uint64_t key) {
+
+	return pc->shard + (key >> (64 - SHARD_BITS));
+}
+
+/* The slot for 'key' in a shard, empty if it isn't there. */
+static struct entry* shard_slot(struct shard *s, uint64_t key) {
+
+	unsigned int i, mask = s->size - 1;
+
+	for(i = key & mask;; i = (i + 1) & mask) {
+		struct entry *e = s->slot + i;
+
+		if (!e->key || e->key == key)
+			return e;
+	}
+}
+
+static struct entry* shard_find(struct shard *s, uint64_t key) {
+
+	struct entry *e;
+
+	if (!s->size)
+		return NULL;
+	e = shard_slot(s, key);
+	return e->key ? e : NULL;
+}
+
+static void shard_grow(struct shard *s) {
+
+	struct entry *old = s->slot;
+	unsigned int i, size = s->size;
+
+	s->size = size ? size * 2 : 64;
+	s->slot = xmallocz(sizeof(*s->slot) * s->size);
+
+	for(i=0; i < size; i++) {
+		if (old[i].key)
+			*shard_slot(s, old[i].key) = old[i];
+	}
+	free(old);
+}
+
+/* Insert 'e', or replace the entry with its key. */
+static void shard_insert(struct shard *s, const struct entry *e) {
+
+	struct entry *slot;
+
+	/* kept at most 3/4 full */
+	if ((s->nr + 1) * 4 > s->size * 3)
+		shard_grow(s);
+
+	slot = shard_slot(s, e->key);
+	if (!slot->key)
+		s->nr++;
+	*slot = *e;
 }
 
-static struct proc_cache_entry* find_in_list(struct proc_cache_entry *ent, 
-					union hash *hash) {
+static struct entry* table_find(struct proc_cache *pc, uint64_t key) {
+
+	return shard_find(get_shard(pc, key), key);
+}
+
+static struct proc_cache_entry* find_in_list(struct proc_cache_entry *ent,
+					struct proc_cache_entry *key) {
 
 	struct llist *it;
 	struct proc_cache_entry *e;
@@ -93,76 +435,430 @@ static struct proc_cache_entry* find_in_list(struct proc_cache_entry *ent,
 	llist_foreach(it, &ent->list) {
 		e = llist_entry(it, struct proc_cache_entry, list);
 
-		if (!he_empty(e) && !memcmp(e->hash.sha1, hash->sha1, 20))
+		if (!he_empty(e) && !memcmp(e->hash.sha1, key->hash.sha1, 20))
 			return e;
 	}
 	return NULL;
 }
 
-static struct proc_cache_entry* lookup(const char *key) {
+static struct proc_cache_entry* legacy_find(struct proc_cache *pc,
+					struct proc_cache_entry *key) {
 
 	struct proc_cache_entry *entry;
-	union hash h;
 
-	hash(&h, key);
+	entry = hash_lookup(&pc->legacy, key->hash.index);
+	return entry ? find_in_list(entry, key) : NULL;
+}
+
+static void legacy_insert(struct proc_cache *pc, struct proc_cache_entry *e) {
 
-	entry = hash_lookup(&table, h.index);
+	struct proc_cache_entry *entry, *dest;
+
+	entry = legacy_find(pc, e);
 	if (entry) {
-		return find_in_list(entry, &h);
+		entry->e = e->e;
+		return;
 	}
-	return NULL;
+
+	entry = xmemdup(e, sizeof(*e));
+	entry->list.next = NULL;
+
+	dest = hash_insert(&pc->legacy, entry->hash.index, entry);
+	if (dest)
+		llist_add(&dest->list, &entry->list);
+	pc->legacy_nr++;
 }
 
-static void he_insert(struct proc_cache_entry *entry) {
+/*
+ * An entry from an older file is moved over to the new key the
+ * first time its item is seen. Returns 0 if there is none.
+ */
+static int migrate(struct proc_cache *pc, const char *url, struct entry *e) {
+
+	struct proc_cache_entry old, *entry;
+	int ret = 0;
+
+	hash_sha1(&old, url);
+
+	pthread_mutex_lock(&pc->mutex);
+	entry = pc->legacy_nr ? legacy_find(pc, &old) : NULL;
+	if (entry) {
+		e->first = entry->e.first;
+		e->last = entry->e.last;
+		e->tag = entry->e.tag;
+		e->flags = HE_FLAG_VALID | HE_FLAG_DIRTY;
+
+		entry->e.flags &= ~HE_FLAG_VALID;
+		pc->legacy_nr--;
+		/* the old entry is only gone once the table is rewritten. */
+		pc->compact = 1;
+		ret = 1;
+	}
+	pthread_mutex_unlock(&pc->mutex);
+	return ret;
+}
+
+/*
+ * Find the entry for 'url' in shard 's' (which is locked) or the
+ * mapped table, a copy of it is put in 'e'. Returns 0 if there is none.
+ */
+static int lookup(struct proc_cache *pc, struct shard *s, const char *url,
+		struct entry *e) {
 
-	struct proc_cache_entry *dest;
+	const unsigned char *slot;
+	struct entry *ent;
 
-	dest = hash_insert(&table, entry->hash.index, entry);
-	if (dest) {
-		if (find_in_list(dest, &entry->hash)) {
-			free(entry);
-			return;
+	ent = shard_find(s, e->key);
+	if (ent) {
+		*e = *ent;
+		return 1;
+	}
+
+	slot = probe(pc->map.slot, pc->map.slots, e->key);
+	if (slot) {
+		get_entry(slot, e);
+		return 1;
+	}
+
+	/* the legacy table doesn't change after open, only
+	   the number of entries left in it. */
+	return pc->legacy.size ? migrate(pc, url, e) : 0;
+}
+
+/* call 'fn' for every valid entry of the legacy table */
+static void for_each_legacy(struct proc_cache *pc,
+			void (*fn)(struct proc_cache *, struct entry *, void *),
+			void *data) {
+
+	unsigned int i;
+
+	for(i=0; i < pc->legacy.size; i++) {
+		struct llist *it, *n;
+		struct proc_cache_entry *e, *entry = hash_entry(&pc->legacy, i);
+
+		if (!entry)
+			continue;
+
+		llist_foreach_safe(it, n, &entry->list) {
+			e = llist_entry(it, struct proc_cache_entry, list);
+			if (!he_empty(e))
+				fn(pc, &e->e, data);
 		}
-		llist_add(&dest->list, &entry->list);
 	}
+}
+
+/*
+ * Call 'fn' for every entry in the cache, those in the mapped table
+ * are passed as a copy, unless they are in one of the shards.
+ */
+static void for_each_live(struct proc_cache *pc,
+			void (*fn)(struct proc_cache *, struct entry *, void *),
+			void *data) {
+
+	struct entry e;
+	unsigned int i, j;
+
+	for(i=0; i < pc->map.slots; i++) {
+		get_entry(pc->map.slot + (size_t) i * SLOT_SZ, &e);
+		if (!e.key || table_find(pc, e.key))
+			continue;
+		fn(pc, &e, data);
+	}
+	for(i=0; i < SHARDS; i++) {
+		struct shard *s = pc->shard + i;
 
-	entry->flags |= HE_FLAG_VALID;
+		for(j=0; j < s->size; j++) {
+			if (s->slot[j].key)
+				fn(pc, s->slot + j, data);
+		}
+	}
+}
+
+static void free_legacy(struct proc_cache *pc) {
+
+	unsigned int i;
+
+	for(i=0; i < pc->legacy.size; i++) {
+		struct llist *it, *n;
+		struct proc_cache_entry *entry = hash_entry(&pc->legacy, i);
+
+		if (!entry)
+			continue;
+
+		llist_foreach_safe(it, n, &entry->list)
+			free(llist_entry(it, struct proc_cache_entry, list));
+	}
+	hash_free(&pc->legacy);
+	pc->legacy_nr = 0;
 }
 
-static void build_table(const char *buf, size_t entries) {
+static unsigned int read_int(const char *buf, size_t *offset) {
+
+	unsigned int val = get_int((const unsigned char *) buf + *offset);
+
+	*offset += sizeof(val);
+	return val;
+}
+
+/*
+ * Read 'entries' entries of a file before version 4, keyed by SHA1
+ * (before version 3) or XXH64. Returns the number of bytes read.
+ */
+static size_t build_table(struct proc_cache *pc, const char *buf,
+			size_t entries, unsigned version, int sha1) {
 
 	size_t i, offset = 0;
 
 	for(i=0; i < entries; i++) {
-		struct proc_cache_entry *entry = calloc(1, sizeof(*entry));
+		struct proc_cache_entry entry;
+		struct entry *e = &entry.e;
+
+		memset(&entry, 0, sizeof(entry));
+		if (sha1) {
+			/* the first word is in network byte order. */
+			memcpy(entry.hash.sha1, buf + offset, 20);
+			entry.hash.index = ntohl(entry.hash.index);
+			/* not a key, only for keep() to pick by. */
+			e->key = get_key(entry.hash.sha1 + 8);
+			offset += 20;
+		} else {
+			e->key = get_key((const unsigned char *) buf + offset);
+			offset += 8;
+		}
+
+		if (version < 2) {
+			e->first = e->last = read_int(buf, &offset);
+		} else {
+			e->first = read_int(buf, &offset);
+			e->last = read_int(buf, &offset);
+			e->tag = read_int(buf, &offset);
+		}
+		e->flags = HE_FLAG_VALID;
+
+		if (sha1)
+			legacy_insert(pc, &entry);
+		else if (e->key)
+			shard_insert(get_shard(pc, e->key), e);
+	}
+	return offset;
+}
+
+static void read_targets(struct proc_cache *pc, const char *buf, size_t size) {
+
+	size_t offset = 0;
+	unsigned i, nr;
+
+	if (size < sizeof(nr))
+		return;
+	nr = read_int(buf, &offset);
+	if (nr > (size - offset) / TARGET_SZ)
+		return;
+
+	for(i=0; i < nr; i++) {
+		struct target_info *t = add_target(pc, read_int(buf, &offset));
+
+		t->walked = read_int(buf, &offset);
+	}
+}
+
+/*
+ * Files before version 4 are read in full, the table
+ * is written in the new format when the cache is closed.
+ */
+static int read_old(struct proc_cache *pc, int fd, size_t size) {
+
+	size_t entries, offset = HDR_SZ_V1, esize = HE_SZ;
+	struct header *hdr;
+	unsigned version;
+	char *buf;
+	int ret = -1;
+
+	buf = malloc(size);
+	if (!buf)
+		return -1;
+	if (read(fd, buf, size) != size)
+		goto error;
+
+	hdr = (struct header *) buf;
+	version = ntohl(hdr->version);
+	entries = ntohl(hdr->entries);
+
+	if (version >= 3) {
+		if (size < HDR_SZ_V3)
+			goto error;
+		pc->seed = ntohl(hdr->seed);
+		offset = HDR_SZ_V3;
+	} else {
+		esize = version < 2 ? HE_SZ_V1 : HE_SZ_V2;
+	}
+
+	if (entries * esize > size - offset) {
+		fprintf(stderr,
+			"proc_cache_open: file truncated. "
+			"expected atleast '%lu' bytes, got '%lu'\n",
+			entries * esize, size - offset);
+		goto error;
+	}
 
-		memcpy(&entry->hash, buf + offset, sizeof(entry->hash));
-		offset += sizeof(entry->hash);
+	offset += build_table(pc, buf + offset, entries, version, version < 3);
 
-		memcpy(&entry->time, buf + offset, sizeof(entry->time));
-		offset += sizeof(entry->time);
+	/* entries of an older file that are still around. */
+	if (version >= 3 && size - offset >= sizeof(unsigned)) {
+		entries = read_int(buf, &offset);
+		if (entries > (size - offset) / HE_SZ_V2) {
+			fprintf(stderr, "proc_cache_open: file truncated.\n");
+			goto error;
+		}
+		offset += build_table(pc, buf + offset, entries, 2, 1);
+	}
 
-		entry->hash.index = ntohl(entry->hash.index);
-		entry->time = ntohl(entry->time);
+	if (version >= 2)
+		read_targets(pc, buf + offset, size - offset);
+
+	pc->compact = 1;
+	ret = 0;
+error:
+	free(buf);
+	return ret;
+}
+
+static int map_table(struct proc_cache *pc, int fd, size_t size) {
+
+	struct header hdr;
+	const char *buf;
+	size_t need, offset;
+	unsigned int i, slots;
+
+	if (read(fd, &hdr, sizeof(hdr)) != sizeof(hdr))
+		return -1;
+
+	slots = ntohl(hdr.slots);
+	need = sizeof(hdr) + (size_t) slots * SLOT_SZ +
+		(size_t) ntohl(hdr.legacy) * HE_SZ_V2 +
+		(size_t) ntohl(hdr.targets) * TARGET_SZ;
+	if ((slots & (slots - 1)) || need > size) {
+		fprintf(stderr, "proc_cache_open: file truncated.\n");
+		return -1;
+	}
 
-		he_insert(entry);
+	pc->map.buf = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (pc->map.buf == MAP_FAILED) {
+		pc->map.buf = NULL;
+		return -1;
 	}
+	pc->map.size = size;
+	pc->map.slot = (unsigned char *) pc->map.buf + sizeof(hdr);
+	pc->map.slots = slots;
+	pc->map.entries = ntohl(hdr.entries);
+	pc->map.compacted = ntohl(hdr.compacted);
+	pc->seed = ntohl(hdr.seed);
+
+	buf = (const char *) pc->map.slot + (size_t) slots * SLOT_SZ;
+	offset = build_table(pc, buf, ntohl(hdr.legacy), 2, 1);
+
+	for(i=0; i < ntohl(hdr.targets); i++) {
+		struct target_info *t = add_target(pc, read_int(buf, &offset));
+
+		t->walked = read_int(buf, &offset);
+	}
+
+	need += sizeof(unsigned);
+	if (need <= size) {
+		unsigned int n = read_int(buf, &offset);
+
+		if ((size - need) / (2 * sizeof(unsigned)) >= n) {
+			pc->map.expiring = (const unsigned char *) buf + offset;
+			pc->map.expiring_nr = n;
+		}
+	}
+	return 0;
 }
 
-int proc_cache_open() {
+/* Replay the changes made since the table was written. */
+static void read_log(struct proc_cache *pc, const char *file) {
+
+	unsigned char *buf, *p;
+	struct stat st;
+	size_t n;
+	int fd;
 
-	char filename[4096], *buf = NULL;
+	fd = open(file, O_RDONLY);
+	if (fd < 0)
+		return;
+	if (fstat(fd, &st) < 0 || !st.st_size) {
+		close(fd);
+		return;
+	}
+
+	buf = malloc(st.st_size);
+	n = buf ? read(fd, buf, st.st_size) : 0;
+	close(fd);
+	if (n != st.st_size) {
+		free(buf);
+		return;
+	}
+
+	/* a record cut short by a crash is ignored */
+	for(p = buf; p + LOG_SZ <= buf + n; p += LOG_SZ) {
+		struct entry e;
+
+		get_entry(p + 4, &e);
+
+		if (get_int(p) == LOG_ENTRY && e.key) {
+			shard_insert(get_shard(pc, e.key), &e);
+		} else if (get_int(p) == LOG_TARGET) {
+			/* the tag in the key, walked as first */
+			add_target(pc, e.key)->walked = e.first;
+		}
+		pc->log_nr++;
+	}
+	free(buf);
+}
+
+static void proc_cache_free(struct proc_cache *pc) {
+
+	unsigned int i;
+
+	if (pc->map.buf)
+		munmap(pc->map.buf, pc->map.size);
+
+	for(i=0; i < SHARDS; i++) {
+		pthread_mutex_destroy(&pc->shard[i].mutex);
+		free(pc->shard[i].slot);
+	}
+	pthread_mutex_destroy(&pc->mutex);
+	free_legacy(pc);
+	free(pc->targets);
+
+	release_lock(&pc->lock);
+	free(pc);
+}
+
+struct proc_cache* proc_cache_open(void) {
+
+	struct lockfile lock = LOCKFILE_INIT_LOCAL;
+	struct proc_cache *pc;
+	char filename[4096];
 	int ret = -1, fd = -1;
-	size_t entries = 0, offset = 0;
 	struct stat st;
-	struct header *hdr;
+	unsigned int i, hdr[2];
+
+	pc = xmallocz(sizeof(*pc));
+	pc->lock = lock;
+	pc->seed = DEFAULT_SEED;
+	pc->limit = DEFAULT_LIMIT;
+	pc->evict_age = AGE_BUCKETS;
+	pc->now = time(NULL);
+	pthread_mutex_init(&pc->mutex, NULL);
+	for(i=0; i < SHARDS; i++)
+		pthread_mutex_init(&pc->shard[i].mutex, NULL);
 
 	/* Open file */
 	snprintf(filename, sizeof(filename),
 		"%s/%s", env_get_dir(), STORAGE_FILE);
 
 	/* try lockin the file */
-	if (hold_lock(&lock, filename) < 0)
+	if (hold_lock(&pc->lock, filename) < 0)
 		goto error;
 
 	fd = open(filename, O_CREAT | O_RDONLY, 0600);
@@ -171,149 +867,522 @@ int proc_cache_open() {
 		goto error;
 	}
 
-	if (st.st_size >= sizeof(*hdr)) {
-
-		buf = malloc(st.st_size);
-		if (!buf)
-			goto error;
+	if (st.st_size < HDR_SZ_V1) {
+		/* nothing yet, write a table on close. */
+		pc->compact = 1;
+		ret = 0;
+		goto error;
+	}
 
-		read(fd, buf, st.st_size);
+	/* Validate header */
+	if (pread(fd, hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+		hdr[0] != htonl(SIGNATURE) ||
+		ntohl(hdr[1]) < 1 || ntohl(hdr[1]) > VERSION) {
+		fprintf(stderr, "proc_cache_open: Invalid header\n");
+		goto error;
+	}
 
-		/* Validate header */
-		hdr = (struct header *) buf;
-		if (hdr->signature != htonl(SIGNATURE) ||
-			hdr->version != htonl(1)) {
-			fprintf(stderr, "proc_cache_open: Invalid header\n");
+	if (ntohl(hdr[1]) < 4) {
+		if (read_old(pc, fd, st.st_size) < 0)
+			goto error;
+	} else {
+		if (map_table(pc, fd, st.st_size) < 0)
 			goto error;
-		}
 
-		entries = htonl(hdr->entries);
+		snprintf(filename, sizeof(filename),
+			"%s/%s", env_get_dir(), LOG_FILE);
+		read_log(pc, filename);
+	}
 
-		offset = sizeof(*hdr);
+	ret = 0;
+error:
+	if (fd >= 0)
+		close(fd);
+	if (ret) {
+		proc_cache_free(pc);
+		return NULL;
 	}
+	return pc;
+}
 
-	if (entries * HE_SZ > st.st_size - offset) {
-		fprintf(stderr,
-			"proc_cache_open: file truncated. "
-			"expected atleast '%lu' bytes, got '%lu'\n",
-			entries * HE_SZ, st.st_size - offset);
-		goto error;
+/*
+ * Items still listed in a feed are touched on every run, so they are
+ * never purged while the feed has them. Changed entries go to the
+ * shard and are written when the cache is closed.
+ */
+static void touch(struct proc_cache *pc, struct shard *s, struct entry *e,
+		const char *target) {
+
+	hash_t t = tag(target);
+
+	if (e->tag != t || e->last + TOUCH_INTERVAL <= pc->now) {
+		e->last = pc->now;
+		e->tag = t;
+		e->flags |= HE_FLAG_DIRTY;
 	}
+	if (e->flags & HE_FLAG_DIRTY)
+		shard_insert(s, e);
+}
 
-	build_table(buf + offset, entries);
+int proc_cache_lookup(struct proc_cache *pc, const char *target,
+		const char *url) {
 
-	ret = 0;
-error:
+	struct shard *s;
+	struct entry e;
+	int ret;
+
+	e.key = hash(pc, url);
+	s = get_shard(pc, e.key);
+
+	pthread_mutex_lock(&s->mutex);
+	ret = lookup(pc, s, url, &e);
 	if (ret)
-		release_lock(&lock);
-	if (buf)
-		free(buf);
-	if (fd >= 0)
-		close(fd);
+		touch(pc, s, &e, target);
+	pthread_mutex_unlock(&s->mutex);
 	return ret;
 }
 
-int proc_cache_lookup(const char *url) {
+void proc_cache_update(struct proc_cache *pc, const char *target,
+		const char *url) {
+
+	struct shard *s;
+	struct entry e;
+
+	e.key = hash(pc, url);
+	s = get_shard(pc, e.key);
+
+	pthread_mutex_lock(&s->mutex);
+	if (!lookup(pc, s, url, &e)) {
+		e.first = pc->now;
+		e.last = 0;
+		e.tag = 0;
+		e.flags = HE_FLAG_VALID;
+	}
+	touch(pc, s, &e, target);
+	pthread_mutex_unlock(&s->mutex);
+}
+
+void proc_cache_walked(struct proc_cache *pc, const char *target) {
+
+	struct target_info *t;
+
+	pthread_mutex_lock(&pc->mutex);
+	t = add_target(pc, tag(target));
+	t->walked = pc->now;
+	t->dirty = 1;
+	pthread_mutex_unlock(&pc->mutex);
+}
+
+/*
+ * Items that stayed in a feed for long may come back (a feed that is
+ * edited, or paged), so keep them at least as long after they were
+ * last seen.
+ */
+static unsigned int retention(struct target_info *t, unsigned int min) {
+
+	if (t->lifetime < min)
+		return min;
+	if (t->lifetime > MAX_AGE)
+		return MAX_AGE;
+	return t->lifetime;
+}
+
+/* not seen in the last full read of its feed. */
+static int gone(struct entry *e, struct target_info *t) {
+
+	return t && e->last + TOUCH_INTERVAL < t->walked;
+}
+
+static void measure_lifetime(struct proc_cache *pc, struct entry *e,
+			void *data) {
+
+	struct target_info *t = e->tag ? find_target(pc, e->tag) : NULL;
+
+	if (gone(e, t) && e->last > e->first &&
+		e->last - e->first > t->lifetime)
+		t->lifetime = e->last - e->first;
+}
+
+static int expired(struct proc_cache *pc, struct entry *e) {
+
+	unsigned int age = e->last < pc->now ? pc->now - e->last : 0;
+	struct target_info *t;
+
+	if (!pc->purge_min)
+		return 0;
+	if (age > MAX_AGE)
+		return 1;
 
-	return lookup(url) != NULL;
+	/* Only the items missing from the last full read of their
+	   feed are known to be gone, a feed that is not modified
+	   (or not read to the end) says nothing about its items. */
+	t = e->tag ? find_target(pc, e->tag) : NULL;
+	return gone(e, t) && age > retention(t, pc->purge_min);
 }
 
-void proc_cache_update(const char *url) {
+/*
+ * Expired entries are dropped when the table is rewritten, it is
+ * the only time all of them are looked at.
+ */
+void proc_cache_purge(struct proc_cache *pc, unsigned int min) {
 
-	struct proc_cache_entry *entry = lookup(url);
+	pc->purge_min = min ? min : 1;
+}
 
-	if (!entry) {
-		entry = calloc(1, sizeof(*entry));
-		hash(&entry->hash, url);
-		he_insert(entry);
+void proc_cache_limit(struct proc_cache *pc, unsigned int entries) {
+
+	pc->limit = entries;
+}
+
+static unsigned int age_bucket(struct proc_cache *pc, struct entry *e) {
+
+	unsigned int age = e->last < pc->now ? pc->now - e->last : 0;
+
+	age /= TOUCH_INTERVAL;
+	return age < AGE_BUCKETS ? age : AGE_BUCKETS - 1;
+}
+
+static int keep(struct proc_cache *pc, struct entry *e) {
+
+	unsigned int age;
+
+	if (expired(pc, e))
+		return 0;
+
+	/* the entries of a bucket were seen about the same time,
+	   which of them go is left to the key. */
+	age = age_bucket(pc, e);
+	if (age == pc->evict_age)
+		return (e->key >> 32) < pc->evict_share;
+	return age < pc->evict_age;
+}
+
+static void count_age(struct proc_cache *pc, struct entry *e, void *data) {
+
+	unsigned int *bucket = data;
+
+	if (!expired(pc, e))
+		bucket[age_bucket(pc, e)]++;
+}
+
+/*
+ * Over the limit, the entries that were not seen for the longest are
+ * evicted, down to 7/8 of it so the table isn't rewritten on every run
+ * after that. Those seen in the last hour are always kept. Returns at
+ * most the number of entries kept.
+ */
+static unsigned int set_eviction(struct proc_cache *pc) {
+
+	unsigned int *bucket, i, n = 0, want = pc->limit - pc->limit / 8;
+
+	bucket = xmallocz(sizeof(*bucket) * AGE_BUCKETS);
+	for_each_live(pc, count_age, bucket);
+	for_each_legacy(pc, count_age, bucket);
+
+	pc->evict_age = AGE_BUCKETS;
+	for(i=0; i < AGE_BUCKETS; i++) {
+		if (pc->limit && i && n + bucket[i] > want) {
+			pc->evict_age = i;
+			pc->evict_share = want > n ?
+				((uint64_t) (want - n) << 32) / bucket[i] : 0;
+			n += bucket[i];
+			break;
+		}
+		n += bucket[i];
 	}
-	entry->time = time(NULL);
+	free(bucket);
+	return n;
 }
 
-void proc_cache_purge(unsigned int timestamp) {
+struct new_table {
+	unsigned char *slot;
+	unsigned int slots;
+	unsigned int entries;
+};
+
+static void insert_slot(struct proc_cache *pc, struct entry *e, void *data) {
 
-	unsigned int i, t, now = time(NULL);
+	struct new_table *t = data;
+	unsigned int i, mask = t->slots - 1;
 
-	if (now < timestamp)
+	if (!keep(pc, e))
 		return;
 
-	t = now - timestamp;
-	for(i=0; i < table.size; i++) {
-		struct llist *it;
-		struct proc_cache_entry *e, *entry = hash_entry(&table, i);
+	for(i = e->key & mask;; i = (i + 1) & mask) {
+		unsigned char *s = t->slot + (size_t) i * SLOT_SZ;
 
-		if (!entry)
-			continue;
+		if (!get_key(s)) {
+			put_entry(s, e);
+			break;
+		}
+	}
+	t->entries++;
+}
 
-		llist_foreach(it, &entry->list) {
-			e = llist_entry(it, struct proc_cache_entry, list);
-			if (!he_empty(e) && e->time <= t)
-				e->flags &= ~HE_FLAG_VALID;
+/* Write all of 'buf', a short write is retried. */
+static int write_in_full(int fd, const void *buf, size_t len) {
+
+	const char *p = buf;
+	ssize_t n;
+
+	while(len) {
+		n = write(fd, p, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			if (!n)
+				errno = ENOSPC;
+			return -1;
 		}
+		p += n;
+		len -= n;
 	}
+	return 0;
 }
 
-static void write_entry(int fd, struct proc_cache_entry *entry) {
+/* a file written to from the for_each_* callbacks. */
+struct output {
+	int fd;
+	int rc;
+};
+
+static void write_legacy(struct proc_cache *pc, struct entry *e, void *data) {
 
-	struct proc_cache_entry ondisk;
+	struct proc_cache_entry *entry;
+	struct output *out = data;
+	unsigned char sha1[20], buf[12];
+	hash_t index;
 
-	memcpy(&ondisk.hash, &entry->hash, 20);
-	ondisk.hash.index = htonl(entry->hash.index);
-	ondisk.time = htonl(entry->time);
+	if (out->rc < 0 || !keep(pc, e))
+		return;
 
-	write(fd, &ondisk.hash, 20);
-	write(fd, &ondisk.time, sizeof(ondisk.time));
+	entry = llist_entry(e, struct proc_cache_entry, e);
+	index = htonl(entry->hash.index);
+	memcpy(sha1, entry->hash.sha1, sizeof(sha1));
+	memcpy(sha1, &index, sizeof(index));
+	put_int(put_int(put_int(buf, e->first), e->last), e->tag);
+	if (write_in_full(out->fd, sha1, sizeof(sha1)) < 0 ||
+		write_in_full(out->fd, buf, sizeof(buf)) < 0)
+		out->rc = -1;
 }
 
-void proc_cache_close() {
+static void count_legacy(struct proc_cache *pc, struct entry *e, void *data) {
 
-	int i;
-	struct header hdr;
-	int fd = lock.fd;
+	if (keep(pc, e))
+		(*(unsigned *) data)++;
+}
 
-	if (table.size < 1)
+/* Count a kept entry that is gone by the hour it expires, an entry
+   still in its feed (or not known to be gone) may not expire. */
+static void count_expiring(struct proc_cache *pc, struct entry *e,
+			void *data) {
+
+	unsigned int *hour = data, when;
+	struct target_info *t;
+
+	if (!keep(pc, e))
 		return;
 
-	hdr.signature = htonl(SIGNATURE);
-	hdr.version = htonl(1);
-	hdr.entries = 0;
+	t = e->tag ? find_target(pc, e->tag) : NULL;
+	if (!gone(e, t))
+		return;
 
-	ftruncate(fd, 0);
-	lseek(fd, sizeof(hdr), SEEK_SET);
+	when = e->last + retention(t, pc->purge_min);
+	when = when > pc->now ? when - pc->now : 0;
+	when = (when + TOUCH_INTERVAL - 1) / TOUCH_INTERVAL;
+	hour[when < AGE_BUCKETS ? when : AGE_BUCKETS - 1]++;
+}
 
-	/* Write hash entries */
-	for(i=0; i < table.size; i++) {
-		struct llist *it, *n;
-		struct proc_cache_entry *entry = hash_entry(&table, i);
+/* The hours in which entries expire, and how many. */
+static int write_expiring(struct proc_cache *pc, int fd) {
 
-		if (!entry)
+	unsigned int *hour, i, n = 0;
+	unsigned char buf[2 * sizeof(unsigned)];
+	int rc;
+
+	hour = xmallocz(sizeof(*hour) * AGE_BUCKETS);
+	for_each_live(pc, count_expiring, hour);
+	for_each_legacy(pc, count_expiring, hour);
+
+	for(i=0; i < AGE_BUCKETS; i++)
+		n += !!hour[i];
+	put_int(buf, n);
+	rc = write_in_full(fd, buf, sizeof(unsigned));
+
+	for(i=0; !rc && i < AGE_BUCKETS; i++) {
+		if (!hour[i])
 			continue;
+		put_int(put_int(buf, i), hour[i]);
+		rc = write_in_full(fd, buf, sizeof(buf));
+	}
+	free(hour);
+	return rc;
+}
 
-		llist_foreach_safe(it, n, &entry->list) {
-			struct proc_cache_entry *e;
+/* The entries that expired since the table was written, as it was
+   counted then. Those seen again since are counted too. */
+static unsigned int expiring(struct proc_cache *pc) {
 
-			e = llist_entry(it, struct proc_cache_entry, list);
-			if (!he_empty(e)) {
-				write_entry(fd, e);
-				hdr.entries++;
-			}
+	const unsigned char *p = pc->map.expiring;
+	unsigned int i, n = 0;
+
+	for(i=0; i < pc->map.expiring_nr; i++, p += 2 * sizeof(unsigned)) {
+		if (pc->map.compacted + get_int(p) * TOUCH_INTERVAL >= pc->now)
+			break;
+		n += get_int(p + sizeof(unsigned));
+	}
+	return n;
+}
+
+/*
+ * Write a new table with the log merged in, the table is kept
+ * at most half full.
+ */
+static int write_table(struct proc_cache *pc, int fd) {
+
+	struct new_table t;
+	struct header hdr;
+	struct output out;
+	unsigned int i, n, old = 0;
+	unsigned char buf[TARGET_SZ];
+
+	if (pc->purge_min) {
+		for(i=0; i < pc->targets_nr; i++)
+			pc->targets[i].lifetime = 0;
+		for_each_live(pc, measure_lifetime, NULL);
+		for_each_legacy(pc, measure_lifetime, NULL);
+	}
 
-			/* free this entry in the linked list. */
-			free(e);
+	n = set_eviction(pc);
+	for(t.slots = MIN_SLOTS; t.slots < n * 2; t.slots *= 2);
+	t.entries = 0;
+	t.slot = calloc(t.slots, SLOT_SZ);
+	if (!t.slot)
+		return -1;
+	for_each_live(pc, insert_slot, &t);
+
+	for_each_legacy(pc, count_legacy, &old);
+
+	hdr.signature = htonl(SIGNATURE);
+	hdr.version = htonl(VERSION);
+	hdr.entries = htonl(t.entries);
+	hdr.seed = htonl(pc->seed);
+	hdr.slots = htonl(t.slots);
+	hdr.legacy = htonl(old);
+	hdr.targets = htonl(pc->targets_nr);
+	hdr.compacted = htonl(pc->now);
+
+	out.fd = fd;
+	out.rc = -1;
+	if (!ftruncate(fd, 0) && lseek(fd, 0, SEEK_SET) == 0 &&
+		!write_in_full(fd, &hdr, sizeof(hdr)) &&
+		!write_in_full(fd, t.slot, (size_t) t.slots * SLOT_SZ))
+		out.rc = 0;
+	free(t.slot);
+
+	for_each_legacy(pc, write_legacy, &out);
+
+	for(i=0; !out.rc && i < pc->targets_nr; i++) {
+		struct target_info *target = pc->targets + i;
+
+		put_int(put_int(buf, target->tag), target->walked);
+		out.rc = write_in_full(fd, buf, sizeof(buf));
+	}
+
+	/* without purge_min nothing expires, it is rewritten
+	   after COMPACT_INTERVAL to look again. */
+	if (!out.rc && pc->purge_min)
+		out.rc = write_expiring(pc, fd);
+	return out.rc;
+}
+
+/* Append what changed in this run to the log. */
+static int write_log(struct proc_cache *pc, const char *file) {
+
+	unsigned char buf[LOG_SZ];
+	unsigned int i, j;
+	int fd, rc = 0;
+
+	fd = open(file, O_WRONLY | O_APPEND | O_CREAT, 0600);
+	if (fd < 0)
+		return -1;
+
+	for(i=0; !rc && i < SHARDS; i++) {
+		struct shard *s = pc->shard + i;
+
+		for(j=0; !rc && j < s->size; j++) {
+			struct entry *e = s->slot + j;
+
+			if (!e->key || !(e->flags & HE_FLAG_DIRTY))
+				continue;
+			put_entry(put_int(buf, LOG_ENTRY), e);
+			rc = write_in_full(fd, buf, sizeof(buf));
 		}
 	}
 
-	/* Now, free the hash table. */
-	hash_free(&table);
+	for(i=0; !rc && i < pc->targets_nr; i++) {
+		struct entry e;
 
-	hdr.entries = htonl(hdr.entries);
+		if (!pc->targets[i].dirty)
+			continue;
+		memset(&e, 0, sizeof(e));
+		e.key = pc->targets[i].tag;
+		e.first = pc->targets[i].walked;
+		put_entry(put_int(buf, LOG_TARGET), &e);
+		rc = write_in_full(fd, buf, sizeof(buf));
+	}
+	if (close(fd) < 0)
+		rc = -1;
+	return rc;
+}
+
+void proc_cache_close(struct proc_cache *pc) {
+
+	char logfile[4096];
+	unsigned int i, j, dirty = 0, entries = 0, max;
+
+	if (!pc)
+		return;
+
+	snprintf(logfile, sizeof(logfile), "%s/%s", env_get_dir(), LOG_FILE);
 
-	/* Write header */
-	lseek(fd, 0, SEEK_SET);
-	write(fd, &hdr, sizeof(hdr));
+	for(i=0; i < SHARDS; i++) {
+		struct shard *s = pc->shard + i;
 
-	/* Flush it to the real file */
-	commit_lock(&lock);
+		for(j=0; j < s->size; j++)
+			dirty += !!(s->slot[j].flags & HE_FLAG_DIRTY);
+		entries += s->nr;
+	}
+	for(i=0; i < pc->targets_nr; i++)
+		dirty += pc->targets[i].dirty;
+
+	max = pc->map.slots / 4 > LOG_MAX ? pc->map.slots / 4 : LOG_MAX;
+	if (pc->log_nr + dirty > max)
+		pc->compact = 1;
+	if (pc->map.expiring) {
+		if (expiring(pc) * EXPIRE_RATIO > pc->map.entries + pc->legacy_nr)
+			pc->compact = 1;
+	} else if (pc->now - pc->map.compacted > COMPACT_INTERVAL) {
+		pc->compact = 1;
+	}
+	/* may count an entry twice, which only rewrites the table early. */
+	entries += pc->map.entries + pc->legacy_nr;
+	if (pc->limit && entries > pc->limit)
+		pc->compact = 1;
+
+	if (pc->compact) {
+		/* the log goes only once the new table is in place. */
+		if (!write_table(pc, pc->lock.fd) && !commit_lock(&pc->lock)) {
+			unlink(logfile);
+			dirty = 0;
+		} else {
+			perror("proc_cache_close");
+			release_lock(&pc->lock);
+		}
+	}
+	/* keep what changed in this run if it isn't in a new table. */
+	if (dirty && write_log(pc, logfile) < 0)
+		perror(logfile);
 
-	release_lock(&lock);
+	proc_cache_free(pc);
 }
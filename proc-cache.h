@@ -20,14 +20,44 @@
 #ifndef PROC_CACHE_H
 #define PROC_CACHE_H
 
-int proc_cache_open();
+struct proc_cache;
 
-int proc_cache_lookup(const char *url);
+/*
+ * Returns NULL if the cache can't be opened (or is locked). Lookups,
+ * updates and proc_cache_walked() may be called from several threads
+ * at once, the other functions only while no one else uses the cache.
+ */
+struct proc_cache* proc_cache_open(void);
+
+/*
+ * Items are kept by the feed (target) they are in. Looking an item up
+ * counts as seeing it, the entry is kept as long as the feed lists it.
+ */
+int proc_cache_lookup(struct proc_cache *pc, const char *target,
+		const char *url);
+
+void proc_cache_update(struct proc_cache *pc, const char *target,
+		const char *url);
 
-void proc_cache_update(const char *url);
+/* 'target' was read to the end, items it didn't list are gone from it. */
+void proc_cache_walked(struct proc_cache *pc, const char *target);
 
-void proc_cache_purge(unsigned int timestamp);
+/*
+ * Drop items that are gone from their feed, once they have been gone
+ * about as long as items usually stay in that feed, but at least 'min'
+ * seconds. Call it after the feeds are processed, the entries are
+ * dropped the next time the table is rewritten on close, which is
+ * done once an eighth of them are due.
+ */
+void proc_cache_purge(struct proc_cache *pc, unsigned int min);
+
+/*
+ * Keep at most 'entries' entries, 0 for no limit. Past it, those not
+ * seen for the longest are evicted the next time the table is
+ * rewritten.
+ */
+void proc_cache_limit(struct proc_cache *pc, unsigned int entries);
 
-void proc_cache_close();
+void proc_cache_close(struct proc_cache *pc);
 
 #endif /* PROC_CACHE_H */
@@ -17,8 +17,14 @@
  *   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
  *   MA 02110-1301, USA.
  */
+/* memmem() */
+#define _GNU_SOURCE
+#include <string.h>
+#include <strings.h>
 #include <libxml/parser.h>
 #include <libxml/tree.h>
+#include "buffer.h"
+#include "xalloc.h"
 #include "rss.h"
 
 /* Sidestep warnings about signedness (xmlChar = unsigned char) */
@@ -58,7 +64,8 @@ static const char* getnodetext(xmlNodePtr node) {
 	if (node) {
 		if (node->type == XML_ELEMENT_NODE)
 			node = node->children;
-		if (node->type == XML_TEXT_NODE)
+		if (node && (node->type == XML_TEXT_NODE ||
+			node->type == XML_CDATA_SECTION_NODE))
 			return (const char *) node->content;
 	}
 	return "";
@@ -150,3 +157,1125 @@ int rss_walk_reset(rss_t rss) {
 	}
 	return 0;
 }
+
+/*
+ * Push parser.
+ *
+ * Uses libxml2's SAX interface and reports each item as soon as its
+ * end tag is parsed, no document tree is built. The document is
+ * held to the same rules as validate(), with the difference that
+ * a violation found after the first item is only reported when it
+ * is encountered, items before it have already been delivered.
+ */
+
+/* element depth of the nodes we care about. */
+#define DEPTH_RSS	1
+#define DEPTH_CHANNEL	2
+#define DEPTH_ITEM	3
+#define DEPTH_FIELD	4
+
+/* what the text collected for the current field is. */
+#define TEXT_NONE	0
+#define TEXT_TEXT	1
+#define TEXT_CDATA	2
+#define TEXT_DONE	3
+
+struct rss_scan;
+
+struct __rss_push {
+	xmlParserCtxtPtr ctxt;
+	rss_item_fn fn;
+	void *data;
+
+	/* fast path state, NULL once libxml2 has taken over. */
+	struct rss_scan *scan;
+	/* items already delivered by the scanner. */
+	unsigned skip;
+
+	unsigned depth;
+	unsigned channel:1;     /* the channel has been seen */
+	unsigned in_channel:1;
+	unsigned in_item:1;
+	unsigned items:1;       /* seen an item in the channel */
+	unsigned invalid:1;
+	unsigned stopped:1;
+
+	/* the field being collected, NULL if none. */
+	struct buffer *field;
+	int text;
+	unsigned has_title:1;
+	unsigned has_link:1;
+	struct buffer title;
+	struct buffer link;
+};
+
+static void push_invalid(struct __rss_push *p) {
+
+	p->invalid = 1;
+	xmlStopParser(p->ctxt);
+}
+
+static void push_start(void *ctx, const xmlChar *name, const xmlChar *prefix,
+			const xmlChar *URI, int nb_namespaces,
+			const xmlChar **namespaces, int nb_attributes,
+			int nb_defaulted, const xmlChar **attrs) {
+
+	struct __rss_push *p = ((xmlParserCtxtPtr) ctx)->_private;
+	int i;
+
+	/* like getnodetext(), only the first child node counts. */
+	if (p->field)
+		p->text = TEXT_DONE;
+
+	switch(++p->depth) {
+	case DEPTH_RSS:
+		for(i=0; i < nb_attributes; i++) {
+			if (!xmlStrcmp(attrs[i*5], "version"))
+				break;
+		}
+		if (xmlStrcmp(name, "rss") || i == nb_attributes)
+			push_invalid(p);
+		break;
+	case DEPTH_CHANNEL:
+		if (p->channel)
+			break;
+		/* first element child must be the channel */
+		if (xmlStrcmp(name, "channel")) {
+			push_invalid(p);
+			break;
+		}
+		p->channel = p->in_channel = 1;
+		break;
+	case DEPTH_ITEM:
+		if (!p->in_channel)
+			break;
+		if (xmlStrcmp(name, "item")) {
+			/* only items may follow the first item. */
+			if (p->items)
+				push_invalid(p);
+			break;
+		}
+		p->items = p->in_item = 1;
+		p->has_title = p->has_link = 0;
+		buffer_free(&p->title);
+		buffer_free(&p->link);
+		break;
+	case DEPTH_FIELD:
+		if (!p->in_item)
+			break;
+		/* the first title and link are used. */
+		if (!p->has_title && !xmlStrcmp(name, "title")) {
+			p->has_title = 1;
+			p->field = &p->title;
+		} else if (!p->has_link && !xmlStrcmp(name, "link")) {
+			p->has_link = 1;
+			p->field = &p->link;
+		} else {
+			break;
+		}
+		p->text = TEXT_NONE;
+		break;
+	}
+}
+
+static void push_end(void *ctx, const xmlChar *name, const xmlChar *prefix,
+			const xmlChar *URI) {
+
+	struct __rss_push *p = ((xmlParserCtxtPtr) ctx)->_private;
+	struct rss_item item;
+
+	switch(p->depth--) {
+	case DEPTH_CHANNEL:
+		p->in_channel = 0;
+		break;
+	case DEPTH_ITEM:
+		if (!p->in_item)
+			break;
+		p->in_item = 0;
+
+		/* delivered before the scanner gave up. */
+		if (p->skip) {
+			p->skip--;
+			break;
+		}
+
+		item.title = buffer_cstr(&p->title);
+		item.link = buffer_cstr(&p->link);
+
+		if (p->fn(&item, p->data)) {
+			p->stopped = 1;
+			xmlStopParser(p->ctxt);
+		}
+		break;
+	case DEPTH_FIELD:
+		p->field = NULL;
+		break;
+	}
+}
+
+static void push_text(struct __rss_push *p, int type,
+			const xmlChar *ch, int len) {
+
+	if (!p->field || p->depth != DEPTH_FIELD)
+		return;
+
+	if (p->text == TEXT_NONE)
+		p->text = type;
+	if (p->text != type) {
+		p->text = TEXT_DONE;
+		return;
+	}
+	buffer_append(p->field, ch, len);
+}
+
+static void push_characters(void *ctx, const xmlChar *ch, int len) {
+
+	push_text(((xmlParserCtxtPtr) ctx)->_private, TEXT_TEXT, ch, len);
+}
+
+static void push_cdata(void *ctx, const xmlChar *ch, int len) {
+
+	push_text(((xmlParserCtxtPtr) ctx)->_private, TEXT_CDATA, ch, len);
+}
+
+static void push_comment(void *ctx, const xmlChar *value) {
+
+	struct __rss_push *p = ((xmlParserCtxtPtr) ctx)->_private;
+
+	if (p->field && p->depth == DEPTH_FIELD)
+		p->text = TEXT_DONE;
+}
+
+static void push_pi(void *ctx, const xmlChar *target, const xmlChar *data) {
+
+	push_comment(ctx, NULL);
+}
+
+/*
+ * Fast path.
+ *
+ * Most feeds are plain <rss><channel><item> documents where all we
+ * want is two child elements per item. The scanner finds the markup
+ * with memchr()/memmem() (which are vectorized in any decent libc),
+ * checks the document is well-formed as it goes and hands out title
+ * and link as slices of the received data, only entities, CDATA and
+ * line ends are decoded.
+ *
+ * It mirrors push_start()/push_end()/push_text() so it yields the same
+ * items as libxml2. Anything it isn't sure about (doctypes, non-utf-8
+ * encodings, namespaced rss elements, non-ascii names and so on) makes
+ * it give up, the data received so far is then handed to libxml2
+ * which carries on from the start, skipping the items already
+ * delivered. The scanner never rejects a document, that is left to
+ * libxml2 so the errors reported stay the same.
+ */
+
+#define SCAN_MORE	0       /* need more data */
+#define SCAN_BAIL	-1      /* let libxml2 handle the document */
+
+#define SCAN_MAX_DEPTH	64
+
+/* byte classes for character data. */
+#define C_OK	0
+#define C_AMP	1
+#define C_LT	2
+#define C_BRACKET 3
+#define C_CR	4
+#define C_HIGH	5
+#define C_BAD	6
+
+static const unsigned char char_class[256] = {
+	/* control characters except tab and newlines are not allowed. */
+	C_BAD, C_BAD, C_BAD, C_BAD, C_BAD, C_BAD, C_BAD, C_BAD,
+	C_BAD, C_OK,  C_OK,  C_BAD, C_BAD, C_CR,  C_BAD, C_BAD,
+	C_BAD, C_BAD, C_BAD, C_BAD, C_BAD, C_BAD, C_BAD, C_BAD,
+	C_BAD, C_BAD, C_BAD, C_BAD, C_BAD, C_BAD, C_BAD, C_BAD,
+	['&'] = C_AMP, ['<'] = C_LT, [']'] = C_BRACKET,
+	[0x80 ... 0xff] = C_HIGH
+};
+
+struct scan_text {
+	size_t start;
+	size_t end;
+	unsigned decode:1;
+	unsigned cdata:1;
+};
+
+struct rss_scan {
+	struct buffer raw;
+	size_t pos;
+
+	/* open elements, as offset and length of their name. */
+	unsigned depth;
+	size_t name[SCAN_MAX_DEPTH];
+	size_t namelen[SCAN_MAX_DEPTH];
+
+	unsigned root:1;
+	unsigned channel:1;
+	unsigned in_channel:1;
+	unsigned in_item:1;
+	unsigned items:1;
+	unsigned has_title:1;
+	unsigned has_link:1;
+
+	struct scan_text *field;
+	int text;
+	struct scan_text title;
+	struct scan_text link;
+	unsigned emitted;
+};
+
+static int is_space(int ch) {
+
+	return ch == ' ' || ch == '\t' || ch == '\n' || ch == '\r';
+}
+
+static int is_name_start(int ch) {
+
+	return (ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') ||
+		ch == '_' || ch == ':';
+}
+
+static int is_name(int ch) {
+
+	return is_name_start(ch) || (ch >= '0' && ch <= '9') ||
+		ch == '-' || ch == '.';
+}
+
+static int is_xml_char(unsigned long c) {
+
+	return c == 0x9 || c == 0xa || c == 0xd ||
+		(c >= 0x20 && c <= 0xd7ff) ||
+		(c >= 0xe000 && c <= 0xfffd) ||
+		(c >= 0x10000 && c <= 0x10ffff);
+}
+
+/*
+ * Returns the length of a valid utf-8 sequence that is also
+ * an allowed xml character, 0 if there is none.
+ */
+static size_t utf8_len(const unsigned char *s, const unsigned char *end) {
+
+	unsigned long c;
+	size_t i, n;
+
+	if (s[0] >= 0xc2 && s[0] <= 0xdf) {
+		n = 2;
+		c = s[0] & 0x1f;
+	} else if (s[0] >= 0xe0 && s[0] <= 0xef) {
+		n = 3;
+		c = s[0] & 0x0f;
+	} else if (s[0] >= 0xf0 && s[0] <= 0xf4) {
+		n = 4;
+		c = s[0] & 0x07;
+	} else {
+		return 0;
+	}
+
+	if (end - s < n)
+		return 0;
+	for(i=1; i < n; i++) {
+		if ((s[i] & 0xc0) != 0x80)
+			return 0;
+		c = (c << 6) | (s[i] & 0x3f);
+	}
+
+	/* reject overlong forms */
+	if ((n == 3 && c < 0x800) || (n == 4 && c < 0x10000))
+		return 0;
+	return is_xml_char(c) ? n : 0;
+}
+
+/*
+ * Parse a character or entity reference at 's'. Returns its length
+ * and stores the character in 'c', or 0 if it is not one of the
+ * predefined entities or a valid character reference.
+ */
+static size_t parse_ref(const char *s, const char *end, unsigned long *c) {
+
+	static const struct {
+		const char *name;
+		size_t len;
+		char c;
+	} ent[] = {
+		{ "&amp;", 5, '&' }, { "&lt;", 4, '<' }, { "&gt;", 4, '>' },
+		{ "&quot;", 6, '"' }, { "&apos;", 6, '\'' }
+	};
+	const char *it;
+	int base = 10, i;
+
+	if (end - s > 1 && s[1] != '#') {
+		for(i=0; i < sizeof(ent) / sizeof(*ent); i++) {
+			if (end - s >= ent[i].len &&
+				!memcmp(s, ent[i].name, ent[i].len)) {
+				*c = ent[i].c;
+				return ent[i].len;
+			}
+		}
+		return 0;
+	}
+
+	it = s + 2;
+	if (it < end && *it == 'x') {
+		base = 16;
+		it++;
+	}
+
+	for(*c = 0, i = 0; it < end && *it != ';'; it++, i++) {
+		int d;
+
+		if (*it >= '0' && *it <= '9')
+			d = *it - '0';
+		else if (base == 16 && *it >= 'a' && *it <= 'f')
+			d = *it - 'a' + 10;
+		else if (base == 16 && *it >= 'A' && *it <= 'F')
+			d = *it - 'A' + 10;
+		else
+			return 0;
+
+		/* anything longer is out of range anyway. */
+		if (i == 8)
+			return 0;
+		*c = *c * base + d;
+	}
+
+	if (it == end || !i || !is_xml_char(*c))
+		return 0;
+	return it - s + 1;
+}
+
+/*
+ * Check character data. Entities and "]]>" are only meaningful
+ * in text and attribute values ('text' set), '<' is never allowed
+ * there. Sets 'decode' if the data is not usable as is.
+ */
+static int check_chars(const char *s, const char *end, int text,
+			unsigned *decode) {
+
+	const unsigned char *it = (const unsigned char *) s;
+	const unsigned char *e = (const unsigned char *) end;
+	unsigned long c;
+	size_t n;
+
+	while(it < e) {
+		switch(char_class[*it]) {
+		case C_OK:
+			it++;
+			break;
+		case C_AMP:
+			if (text) {
+				n = parse_ref((const char *) it, end, &c);
+				if (!n)
+					return -1;
+				*decode = 1;
+				it += n;
+			} else {
+				it++;
+			}
+			break;
+		case C_LT:
+			if (text)
+				return -1;
+			it++;
+			break;
+		case C_BRACKET:
+			if (text && e - it >= 3 && !memcmp(it, "]]>", 3))
+				return -1;
+			it++;
+			break;
+		case C_CR:
+			*decode = 1;
+			it++;
+			break;
+		case C_HIGH:
+			n = utf8_len(it, e);
+			if (!n)
+				return -1;
+			it += n;
+			break;
+		default:
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static void append_utf8(struct buffer *b, unsigned long c) {
+
+	if (c < 0x80) {
+		buffer_append_ch(b, c);
+	} else if (c < 0x800) {
+		buffer_append_ch(b, 0xc0 | (c >> 6));
+		buffer_append_ch(b, 0x80 | (c & 0x3f));
+	} else if (c < 0x10000) {
+		buffer_append_ch(b, 0xe0 | (c >> 12));
+		buffer_append_ch(b, 0x80 | ((c >> 6) & 0x3f));
+		buffer_append_ch(b, 0x80 | (c & 0x3f));
+	} else {
+		buffer_append_ch(b, 0xf0 | (c >> 18));
+		buffer_append_ch(b, 0x80 | ((c >> 12) & 0x3f));
+		buffer_append_ch(b, 0x80 | ((c >> 6) & 0x3f));
+		buffer_append_ch(b, 0x80 | (c & 0x3f));
+	}
+}
+
+/* decode already checked character data into 'b'. */
+static void decode_chars(struct buffer *b, const char *s, const char *end,
+			int text) {
+
+	unsigned long c;
+
+	while(s < end) {
+		const char *it = s;
+
+		while(it < end && *it != '\r' && (!text || *it != '&'))
+			it++;
+		buffer_append(b, s, it - s);
+		if (it == end)
+			break;
+
+		if (*it == '\r') {
+			/* "\r\n" and lone "\r" both become "\n" */
+			buffer_append_ch(b, '\n');
+			s = it + 1;
+			if (s < end && *s == '\n')
+				s++;
+		} else {
+			s = it + parse_ref(it, end, &c);
+			append_utf8(b, c);
+		}
+	}
+}
+
+static int name_is(const char *name, size_t len, const char *str) {
+
+	return len == strlen(str) && !memcmp(name, str, len);
+}
+
+/*
+ * Prefixed names are only trouble if the local part is one of the
+ * names we look for at that point ('what'), whether it matches
+ * depends on the namespace declarations then.
+ */
+static int check_name(const char *name, size_t len,
+			const char *const *what) {
+
+	const char *colon = memchr(name, ':', len);
+	size_t n;
+
+	if (!colon)
+		return 0;
+	if (colon == name || memchr(colon + 1, ':', name + len - colon - 1))
+		return -1;
+
+	n = name + len - colon - 1;
+	for(; *what; what++) {
+		if (name_is(colon + 1, n, *what))
+			return -1;
+	}
+	return 0;
+}
+
+static int scan_emit(struct __rss_push *p) {
+
+	struct rss_scan *s = p->scan;
+	char *raw = (char *) s->raw.block;
+	struct scan_text *field[2] = { &s->title, &s->link };
+	struct buffer *buf[2] = { &p->title, &p->link };
+	const char *str[2];
+	char saved[2];
+	struct rss_item item;
+	int i, ret;
+
+	for(i=0; i < 2; i++) {
+		struct scan_text *t = field[i];
+
+		saved[i] = 0;
+		if (t->start == t->end) {
+			str[i] = "";
+		} else if (t->decode) {
+			buffer_setlen(buf[i], 0);
+			decode_chars(buf[i], raw + t->start, raw + t->end,
+				!t->cdata);
+			str[i] = buffer_cstr(buf[i]);
+		} else {
+			/* the byte after the text is markup ('<' or ']'),
+			   terminate the string in place for the call. */
+			saved[i] = raw[t->end];
+			raw[t->end] = '\0';
+			str[i] = raw + t->start;
+		}
+	}
+
+	item.title = str[0];
+	item.link = str[1];
+	ret = p->fn(&item, p->data);
+	s->emitted++;
+
+	for(i=0; i < 2; i++) {
+		if (saved[i])
+			raw[field[i]->end] = saved[i];
+	}
+
+	if (ret) {
+		p->stopped = 1;
+		return -1;
+	}
+	return 0;
+}
+
+/* see push_start() */
+static int scan_start(struct __rss_push *p, const char *name, size_t len,
+			int version) {
+
+	struct rss_scan *s = p->scan;
+
+	if (s->field)
+		s->text = TEXT_DONE;
+
+	switch(s->depth + 1) {
+	case DEPTH_RSS:
+		if (s->root || !name_is(name, len, "rss") || !version)
+			return SCAN_BAIL;
+		s->root = 1;
+		break;
+	case DEPTH_CHANNEL:
+		if (s->channel)
+			break;
+		if (!name_is(name, len, "channel"))
+			return SCAN_BAIL;
+		s->channel = s->in_channel = 1;
+		break;
+	case DEPTH_ITEM:
+		if (!s->in_channel)
+			break;
+		if (!name_is(name, len, "item")) {
+			if (s->items)
+				return SCAN_BAIL;
+			break;
+		}
+		s->items = s->in_item = 1;
+		s->has_title = s->has_link = 0;
+		memset(&s->title, 0, sizeof(s->title));
+		memset(&s->link, 0, sizeof(s->link));
+		break;
+	case DEPTH_FIELD:
+		if (!s->in_item)
+			break;
+		if (!s->has_title && name_is(name, len, "title")) {
+			s->has_title = 1;
+			s->field = &s->title;
+		} else if (!s->has_link && name_is(name, len, "link")) {
+			s->has_link = 1;
+			s->field = &s->link;
+		} else {
+			break;
+		}
+		s->text = TEXT_NONE;
+		break;
+	}
+
+	if (s->depth == SCAN_MAX_DEPTH)
+		return SCAN_BAIL;
+	s->name[s->depth] = name - (char *) s->raw.block;
+	s->namelen[s->depth] = len;
+	s->depth++;
+	return 1;
+}
+
+/* see push_end() */
+static int scan_end(struct __rss_push *p) {
+
+	struct rss_scan *s = p->scan;
+
+	switch(s->depth--) {
+	case DEPTH_CHANNEL:
+		s->in_channel = 0;
+		break;
+	case DEPTH_ITEM:
+		if (!s->in_item)
+			break;
+		s->in_item = 0;
+		if (scan_emit(p) < 0)
+			return SCAN_BAIL;
+		break;
+	case DEPTH_FIELD:
+		s->field = NULL;
+		break;
+	}
+	return 1;
+}
+
+/* see push_text() */
+static int scan_text(struct __rss_push *p, const char *start,
+			const char *end, int cdata) {
+
+	struct rss_scan *s = p->scan;
+	struct scan_text *t = s->field;
+	unsigned decode = 0;
+	const char *it;
+
+	if (!s->depth) {
+		for(it = start; it < end; it++) {
+			if (!is_space(*it))
+				return SCAN_BAIL;
+		}
+		return 1;
+	}
+
+	if (check_chars(start, end, !cdata, &decode) < 0)
+		return SCAN_BAIL;
+
+	if (!t || s->depth != DEPTH_FIELD)
+		return 1;
+
+	if (s->text == TEXT_NONE) {
+		/* libxml2 may not report empty cdata sections. */
+		if (start == end)
+			return SCAN_BAIL;
+		s->text = cdata ? TEXT_CDATA : TEXT_TEXT;
+		t->start = start - (char *) s->raw.block;
+		t->end = end - (char *) s->raw.block;
+		t->decode = decode;
+		t->cdata = cdata;
+	} else if (s->text != TEXT_DONE) {
+		/* consecutive cdata sections, not worth the trouble. */
+		if (s->text == (cdata ? TEXT_CDATA : TEXT_TEXT))
+			return SCAN_BAIL;
+		s->text = TEXT_DONE;
+	}
+	return 1;
+}
+
+/*
+ * Parse ' name="value"' of the xml declaration. Returns the length
+ * of the value and advances 'it' past it, -1 if it isn't there.
+ */
+static int decl_attr(const char **it, const char *end, const char *name,
+			const char **val) {
+
+	const char *s = *it;
+	size_t len = strlen(name);
+	char quote;
+
+	if (s == end || !is_space(*s))
+		return -1;
+	for(; s < end && is_space(*s); s++);
+	if (end - s < len || memcmp(s, name, len))
+		return -1;
+	for(s += len; s < end && is_space(*s); s++);
+	if (s == end || *s++ != '=')
+		return -1;
+	for(; s < end && is_space(*s); s++);
+	if (s == end || (*s != '"' && *s != '\''))
+		return -1;
+
+	quote = *s++;
+	*val = s;
+	for(; s < end && *s != quote; s++);
+	if (s == end)
+		return -1;
+	*it = s + 1;
+	return s - *val;
+}
+
+/* "<?xml ...?>", must come first and say utf-8 if anything. */
+static int scan_decl(const char *it, const char *end) {
+
+	const char *val;
+	int len;
+
+	len = decl_attr(&it, end, "version", &val);
+	if (len != 3 || memcmp(val, "1.0", 3))
+		return SCAN_BAIL;
+
+	len = decl_attr(&it, end, "encoding", &val);
+	if (len >= 0 && (len != 5 || strncasecmp(val, "utf-8", 5)))
+		return SCAN_BAIL;
+
+	len = decl_attr(&it, end, "standalone", &val);
+	if (len >= 0 && (len != 3 || memcmp(val, "yes", 3)) &&
+		(len != 2 || memcmp(val, "no", 2)))
+		return SCAN_BAIL;
+
+	for(; it < end && is_space(*it); it++);
+	return it == end ? 1 : SCAN_BAIL;
+}
+
+/* "<?target ...?>" */
+static int scan_pi(struct __rss_push *p, const char *lt, const char *end) {
+
+	struct rss_scan *s = p->scan;
+	const char *close = memmem(lt + 2, end - lt - 2, "?>", 2);
+	const char *it;
+	unsigned decode;
+
+	if (!close)
+		return SCAN_MORE;
+
+	for(it = lt + 2; it < close && is_name(*it); it++);
+	if (it == lt + 2 || !is_name_start(lt[2]) ||
+		(it < close && !is_space(*it)))
+		return SCAN_BAIL;
+
+	if (it - lt - 2 == 3 && !strncasecmp(lt + 2, "xml", 3)) {
+		if (lt != (char *) s->raw.block)
+			return SCAN_BAIL;
+		if (scan_decl(it, close) < 0)
+			return SCAN_BAIL;
+	} else {
+		if (check_chars(it, close, 0, &decode) < 0)
+			return SCAN_BAIL;
+		/* see push_pi() */
+		if (s->field && s->depth == DEPTH_FIELD)
+			s->text = TEXT_DONE;
+	}
+	return close + 2 - lt;
+}
+
+/* "<!-- ... -->" and "<![CDATA[ ... ]]>" */
+static int scan_bang(struct __rss_push *p, const char *lt, const char *end) {
+
+	struct rss_scan *s = p->scan;
+	const char *close;
+	unsigned decode;
+
+	if (end - lt < 4)
+		return SCAN_MORE;
+
+	if (!memcmp(lt, "<!--", 4)) {
+		close = memmem(lt + 4, end - lt - 4, "-->", 3);
+		if (!close)
+			return SCAN_MORE;
+		/* "--" is not allowed within comments. */
+		if (memmem(lt + 4, close - lt - 3, "--", 2))
+			return SCAN_BAIL;
+		if (check_chars(lt + 4, close, 0, &decode) < 0)
+			return SCAN_BAIL;
+		/* see push_comment() */
+		if (s->field && s->depth == DEPTH_FIELD)
+			s->text = TEXT_DONE;
+		return close + 3 - lt;
+	}
+
+	if (end - lt < 9)
+		return memcmp(lt, "<![CDATA[", end - lt) ? SCAN_BAIL : SCAN_MORE;
+	if (memcmp(lt, "<![CDATA[", 9) || !s->depth)
+		return SCAN_BAIL;
+
+	close = memmem(lt + 9, end - lt - 9, "]]>", 3);
+	if (!close)
+		return SCAN_MORE;
+	if (scan_text(p, lt + 9, close, 1) < 0)
+		return SCAN_BAIL;
+	return close + 3 - lt;
+}
+
+/* "</name>" */
+static int scan_close(struct __rss_push *p, const char *lt, const char *end) {
+
+	struct rss_scan *s = p->scan;
+	const char *gt = memchr(lt, '>', end - lt);
+	const char *name = lt + 2, *it;
+	size_t len;
+
+	if (!gt)
+		return SCAN_MORE;
+
+	for(it = name; it < gt && is_name(*it); it++);
+	len = it - name;
+	for(; it < gt && is_space(*it); it++);
+
+	if (it != gt || !s->depth ||
+		s->namelen[s->depth - 1] != len ||
+		memcmp((char *) s->raw.block + s->name[s->depth - 1],
+			name, len))
+		return SCAN_BAIL;
+
+	if (scan_end(p) < 0)
+		return SCAN_BAIL;
+	return gt + 1 - lt;
+}
+
+/* names looked for at each depth, see scan_start(). */
+static const char *const depth_names[][3] = {
+	{ "rss" }, { "channel" }, { "item" }, { "title", "link" }
+};
+
+static const char *const root_attrs[] = { "version", NULL };
+
+/* "<name attr="value" ...>" or "<name .../>" */
+static int scan_open(struct __rss_push *p, const char *lt, const char *end) {
+
+	struct rss_scan *s = p->scan;
+	const char *name = lt + 1, *it;
+	const char *attr[16];
+	size_t attrlen[16];
+	unsigned i, nr = 0;
+	unsigned decode;
+	int version = 0;
+	size_t len;
+
+	if (!is_name_start(*name))
+		return SCAN_BAIL;
+	for(it = name; it < end && is_name(*it); it++);
+	len = it - name;
+	if (s->depth < DEPTH_FIELD &&
+		check_name(name, len, depth_names[s->depth]) < 0)
+		return SCAN_BAIL;
+
+	for(;;) {
+		const char *ws = it, *val;
+		char quote;
+
+		for(; it < end && is_space(*it); it++);
+		if (it == end)
+			return SCAN_MORE;
+
+		if (*it == '>' || *it == '/')
+			break;
+
+		/* attributes must be separated by whitespace. */
+		if (it == ws || !is_name_start(*it) || nr == 16)
+			return SCAN_BAIL;
+
+		attr[nr] = it;
+		for(; it < end && is_name(*it); it++);
+		attrlen[nr] = it - attr[nr];
+		if (!s->depth && check_name(attr[nr], attrlen[nr], root_attrs) < 0)
+			return SCAN_BAIL;
+
+		for(i=0; i < nr; i++) {
+			if (attrlen[i] == attrlen[nr] &&
+				!memcmp(attr[i], attr[nr], attrlen[nr]))
+				return SCAN_BAIL;
+		}
+		if (attrlen[nr] == 7 && !memcmp(attr[nr], "version", 7))
+			version = 1;
+		nr++;
+
+		for(; it < end && is_space(*it); it++);
+		if (it == end)
+			return SCAN_MORE;
+		if (*it != '=')
+			return SCAN_BAIL;
+		for(it++; it < end && is_space(*it); it++);
+		if (it >= end)
+			return SCAN_MORE;
+
+		quote = *it++;
+		if (quote != '"' && quote != '\'')
+			return SCAN_BAIL;
+		val = it;
+		it = memchr(val, quote, end - val);
+		if (!it)
+			return SCAN_MORE;
+		if (check_chars(val, it, 1, &decode) < 0)
+			return SCAN_BAIL;
+		it++;
+	}
+
+	if (*it == '/') {
+		if (++it == end)
+			return SCAN_MORE;
+		if (*it != '>')
+			return SCAN_BAIL;
+	}
+
+	if (scan_start(p, name, len, version) < 0)
+		return SCAN_BAIL;
+	/* empty element */
+	if (it[-1] == '/' && scan_end(p) < 0)
+		return SCAN_BAIL;
+
+	return it + 1 - lt;
+}
+
+/*
+ * Scan as much of the received data as possible. Returns SCAN_MORE
+ * if it needs more data and SCAN_BAIL if it gave up or the callback
+ * stopped it.
+ */
+static int scan(struct __rss_push *p) {
+
+	struct rss_scan *s = p->scan;
+
+	for(;;) {
+		const char *buf = (const char *) s->raw.block;
+		const char *cur = buf + s->pos, *end = buf + s->raw.len;
+		const char *lt = memchr(cur, '<', end - cur);
+		int n;
+
+		if (!lt)
+			return SCAN_MORE;
+
+		if (lt > cur) {
+			if (scan_text(p, cur, lt, 0) < 0)
+				return SCAN_BAIL;
+			s->pos = lt - buf;
+		}
+
+		if (end - lt < 2)
+			return SCAN_MORE;
+
+		if (lt[1] == '/')
+			n = scan_close(p, lt, end);
+		else if (lt[1] == '?')
+			n = scan_pi(p, lt, end);
+		else if (lt[1] == '!')
+			n = scan_bang(p, lt, end);
+		else
+			n = scan_open(p, lt, end);
+
+		if (n <= 0)
+			return n;
+		s->pos += n;
+	}
+}
+
+/* the whole document has been received. */
+static int scan_finish(struct __rss_push *p) {
+
+	struct rss_scan *s = p->scan;
+	const char *it = (const char *) s->raw.block + s->pos;
+	const char *end = (const char *) s->raw.block + s->raw.len;
+
+	for(; it < end; it++) {
+		if (!is_space(*it))
+			return SCAN_BAIL;
+	}
+
+	if (!s->root || s->depth || !s->items)
+		return SCAN_BAIL;
+	return 0;
+}
+
+static void scan_free(struct __rss_push *p) {
+
+	if (!p->scan)
+		return;
+	buffer_free(&p->scan->raw);
+	free(p->scan);
+	p->scan = NULL;
+}
+
+static int push_init(struct __rss_push *p) {
+
+	xmlSAXHandler sax;
+
+	memset(&sax, 0, sizeof(sax));
+	sax.initialized = XML_SAX2_MAGIC;
+	sax.startElementNs = push_start;
+	sax.endElementNs = push_end;
+	sax.characters = push_characters;
+	sax.cdataBlock = push_cdata;
+	sax.comment = push_comment;
+	sax.processingInstruction = push_pi;
+	sax.warning = xmlParserWarning;
+	sax.error = xmlParserError;
+
+	p->ctxt = xmlCreatePushParserCtxt(&sax, NULL, NULL, 0, "noname.xml");
+	if (!p->ctxt)
+		return -1;
+	p->ctxt->_private = p;
+	return 0;
+}
+
+/* hand everything received so far over to libxml2. */
+static void push_fallback(struct __rss_push *p) {
+
+	struct rss_scan *s = p->scan;
+
+	p->scan = NULL;
+	p->skip = s->emitted;
+
+	if (push_init(p) < 0) {
+		p->invalid = 1;
+	} else if (s->raw.len) {
+		xmlParseChunk(p->ctxt, (const char *) s->raw.block,
+			s->raw.len, 0);
+	}
+
+	buffer_free(&s->raw);
+	free(s);
+}
+
+rss_push_t rss_push_new(rss_item_fn fn, void *data, int flags) {
+
+	struct __rss_push *p = xmallocz(sizeof(struct __rss_push));
+
+	if (flags & RSS_PUSH_SCAN) {
+		p->scan = xmallocz(sizeof(struct rss_scan));
+		buffer_init(&p->scan->raw);
+	} else if (push_init(p) < 0) {
+		free(p);
+		return NULL;
+	}
+
+	p->fn = fn;
+	p->data = data;
+	buffer_init(&p->title);
+	buffer_init(&p->link);
+
+	return p;
+}
+
+static int push_status(struct __rss_push *p) {
+
+	if (p->stopped)
+		return 1;
+	if (p->invalid || (p->ctxt && !p->ctxt->wellFormed))
+		return -1;
+	return 0;
+}
+
+int rss_push_feed(rss_push_t p, const void *buf, size_t size) {
+
+	if (push_status(p))
+		return push_status(p);
+
+	if (p->scan) {
+		buffer_append(&p->scan->raw, buf, size);
+		if (scan(p) == SCAN_BAIL && !p->stopped)
+			push_fallback(p);
+	} else {
+		xmlParseChunk(p->ctxt, buf, size, 0);
+	}
+	return push_status(p);
+}
+
+int rss_push_end(rss_push_t p) {
+
+	if (push_status(p))
+		return push_status(p);
+
+	if (p->scan) {
+		if (!scan_finish(p))
+			return 0;
+		push_fallback(p);
+		if (push_status(p))
+			return push_status(p);
+	}
+
+	xmlParseChunk(p->ctxt, NULL, 0, 1);
+
+	/* there must be a channel with atleast one item. */
+	if (!p->items)
+		p->invalid = 1;
+	return push_status(p);
+}
+
+void rss_push_free(rss_push_t p) {
+
+	if (!p)
+		return;
+	scan_free(p);
+	if (p->ctxt) {
+		if (p->ctxt->myDoc)
+			xmlFreeDoc(p->ctxt->myDoc);
+		xmlFreeParserCtxt(p->ctxt);
+	}
+	buffer_free(&p->title);
+	buffer_free(&p->link);
+	free(p);
+}
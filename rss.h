@@ -40,4 +40,32 @@ int rss_walk_next(rss_t rss, struct rss_item *item);
 
 int rss_walk_reset(rss_t rss);
 
+/*
+ * push interface, parses the document as it arrives.
+ *
+ * 'fn' is called for each item as soon as it is complete, the item
+ * is only valid during the call. Returning non-zero from 'fn' stops
+ * the parser.
+ *
+ * rss_push_feed() and rss_push_end() return 0 while everything is
+ * fine, 1 if stopped by the callback and -1 if the document is not
+ * a valid rss document.
+ *
+ * With RSS_PUSH_SCAN plain documents are handled by a fast scanner
+ * instead of libxml2, this keeps the whole document in memory.
+ */
+#define RSS_PUSH_SCAN 1
+
+typedef struct __rss_push* rss_push_t;
+
+typedef int (*rss_item_fn)(struct rss_item *item, void *data);
+
+rss_push_t rss_push_new(rss_item_fn fn, void *data, int flags);
+
+int rss_push_feed(rss_push_t p, const void *buf, size_t size);
+
+int rss_push_end(rss_push_t p);
+
+void rss_push_free(rss_push_t p);
+
 #endif
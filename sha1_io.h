@@ -24,7 +24,8 @@
 #include <arpa/inet.h>
 #include <openssl/sha.h>
 
-inline int sha1_write(SHA_CTX *ctx, int fd, void *buf, size_t size) {
+static inline int sha1_write(SHA_CTX *ctx, int fd, const void *buf,
+			size_t size) {
 
 	SHA1_Update(ctx, buf, size);
 	return write(fd, buf, size);
@@ -33,7 +34,7 @@ inline int sha1_write(SHA_CTX *ctx, int fd, void *buf, size_t size) {
 /* This function makes sure that the integer is in
    network byte order before it is written to disk
    by 'sha1_write'. */
-inline int sha1_write_int(SHA_CTX *ctx, int fd, int val) {
+static inline int sha1_write_int(SHA_CTX *ctx, int fd, int val) {
 
 	val = htonl(val);
 	return sha1_write(ctx, fd, &val, sizeof val);